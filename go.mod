@@ -1,3 +1,3 @@
 module github.com/polevpn/webview
 
-go 1.13
+go 1.20
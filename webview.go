@@ -16,12 +16,20 @@ package webview
 #include <stdlib.h>
 #include <stdint.h>
 
-extern void _webviewDispatchGoCallback(void *);
+extern void _webviewDispatchGoCallback(webview_t);
 static inline void _webview_dispatch_cb(webview_t w, void *arg) {
-	_webviewDispatchGoCallback(arg);
+	_webviewDispatchGoCallback(w);
 }
-static inline void CgoWebViewDispatch(webview_t w, uintptr_t arg) {
-	webview_dispatch(w, _webview_dispatch_cb, (void *)arg);
+static inline void CgoWebViewDispatch(webview_t w) {
+	webview_dispatch(w, _webview_dispatch_cb, NULL);
+}
+
+extern void _webviewPageGoCallback(webview_t);
+static inline void _webview_page_cb(webview_t w, void *arg) {
+	_webviewPageGoCallback(w);
+}
+static inline void CgoWebViewOnPage(webview_t w) {
+	webview_set_page_callback(w, _webview_page_cb, NULL);
 }
 
 struct binding_context {
@@ -33,20 +41,30 @@ static inline void _webview_binding_cb(const char *id, const char *req, void *ar
 	struct binding_context *ctx = (struct binding_context *) arg;
 	_webviewBindingGoCallback(ctx->w, (char *)id, (char *)req, ctx->index);
 }
+extern void _webviewBindingGoFree(webview_t, uintptr_t);
+static inline void _webview_binding_free(void *arg) {
+	struct binding_context *ctx = (struct binding_context *) arg;
+	_webviewBindingGoFree(ctx->w, ctx->index);
+	free(ctx);
+}
 static inline void CgoWebViewBind(webview_t w, const char *name, uintptr_t index) {
 	struct binding_context *ctx = calloc(1, sizeof(struct binding_context));
 	ctx->w = w;
 	ctx->index = index;
-	webview_bind(w, name, _webview_binding_cb, (void *)ctx);
+	webview_bind_owned(w, name, _webview_binding_cb, (void *)ctx,
+		_webview_binding_free);
 }
 */
 import "C"
 import (
+	"bytes"
+	"context"
 	"encoding/json"
 	"errors"
 	"reflect"
 	"runtime"
 	"sync"
+	"sync/atomic"
 	"unsafe"
 )
 
@@ -72,6 +90,26 @@ const (
 	HintMax = C.WEBVIEW_HINT_MAX
 )
 
+// JS is a binding result that is already JSON and is passed to JavaScript as
+// it is, without being encoded again. Plain []byte results are encoded like
+// any other value, as base64 strings.
+type JS []byte
+
+// Overflow policies decide which binding call is rejected when the calls
+// waiting to run exceed the limit set with SetBindingLimit.
+type Overflow int
+
+const (
+	// The new call is rejected
+	OverflowReject = C.WEBVIEW_OVERFLOW_REJECT
+
+	// The oldest waiting call is rejected
+	OverflowDropOldest = C.WEBVIEW_OVERFLOW_DROP_OLDEST
+
+	// The new call replaces the newest waiting one, which is rejected
+	OverflowMergeLatest = C.WEBVIEW_OVERFLOW_MERGE_LATEST
+)
+
 type WebView interface {
 
 	// Run runs the main loop until it's terminated. After this function exits -
@@ -134,20 +172,270 @@ type WebView interface {
 	//
 	// f must be a function
 	// f must return either value and error or just error
+	//
+	// Results are sent to JavaScript as JSON. A JS or json.RawMessage result
+	// must already be JSON and is passed on as it is.
 	Bind(name string, f interface{}) error
+
+	// BindAsync binds a callback function like Bind, but runs it on its own
+	// goroutine so that a slow function does not block the main loop. The first
+	// argument of f must be a context.Context, the remaining ones are passed
+	// from JavaScript. The context is cancelled when another page is loaded,
+	// also by a link or a reload on GTK, or when the webview is destroyed.
+	// Calls still running when Navigate leaves the page reject in JavaScript,
+	// their results are dropped.
+	BindAsync(name string, f interface{}) error
+
+	// Unbind removes a function bound with Bind or BindAsync, both from the
+	// current page and from pages loaded later. Binding the same name again
+	// replaces the previous function without calling Unbind.
+	Unbind(name string)
+
+	// SetBindingLimit bounds the number of calls of a bound function that wait
+	// to run. Calls then run one at a time between other main loop work, so a
+	// page calling in a tight loop can not starve the main thread. Calls that
+	// don't fit reject in JavaScript with an Error named "SaturatedError". A
+	// limit of zero removes the bound. It may be called from any goroutine,
+	// the limit applies once the main loop gets to it.
+	SetBindingLimit(name string, limit int, policy Overflow)
+
+	// SetAsyncLimit sets how many BindAsync callbacks may run at the same time,
+	// further calls wait for one of them to finish. The default is 16. Calls
+	// beyond maxAsyncWaiting waiting ones reject in JavaScript.
+	SetAsyncLimit(n int)
 }
 
+type bindingFunc func(id, req string) (interface{}, error)
+
+// asyncBinding runs a BindAsync callback with the context of the page that
+// called it.
+type asyncBinding func(ctx context.Context, req string) (interface{}, error)
+
+const defaultAsyncLimit = 16
+
+// maxAsyncWaiting bounds the BindAsync calls waiting for a free slot, each
+// of them holds a goroutine.
+const maxAsyncWaiting = 1024
+
+var (
+	errAsyncSaturated = errors.New("too many async calls are waiting")
+	errPageLeft       = errors.New("the page was left")
+)
+
 type webview struct {
-	w C.webview_t
+	w        C.webview_t
+	dispatch dispatchQueue
+	bindings handleTable // bindingFunc or asyncBinding
+
+	// Async bindings return from other goroutines, Destroy waits for them.
+	mu        sync.RWMutex
+	destroyed bool
+	page      context.Context // Cancelled when the page is left
+	leave     context.CancelFunc
+	slots     chan struct{}       // Semaphore of running async bindings
+	waiting   int                 // Async calls waiting for a slot
+	calls     map[string]struct{} // Unsettled async calls of the page
+}
+
+const (
+	handleIndexBits = 20
+	handleIndexMask = 1<<handleIndexBits - 1
+	handleChunkBits = 8
+	handleChunkSize = 1 << handleChunkBits
+	handleMaxChunks = 1 << (handleIndexBits - handleChunkBits)
+)
+
+// handleTable maps handles, which are passed through C as opaque pointers,
+// to Go values. A handle is a slot index plus the generation of the slot, so
+// a stale handle never resolves to a value stored later in the same slot.
+// Free slots form a lock-free list and slots are claimed with CAS on their
+// state, so neither lookups nor allocations take locks.
+type handleTable struct {
+	head   atomic.Uint64 // Free list: ABA tag << 32 | first slot index + 1
+	chunks atomic.Value  // []*handleChunk, replaced as a whole on growth
+	grow   sync.Mutex
+}
+
+type handleChunk [handleChunkSize]handleSlot
+
+// Slot flags, stored in the low bits of handleSlot.state below the
+// generation. A live slot is marked busy while its value is read, it can not
+// be released until the reader is done.
+const (
+	slotLive      = 1 << 0
+	slotBusy      = 1 << 1
+	slotStateBits = 2
+)
+
+type handleSlot struct {
+	state atomic.Uint64 // Generation << slotStateBits | slot state
+	next  atomic.Uint32 // Next free slot index + 1
+	v     interface{}   // Guarded by state
+}
+
+const handleGenMask = ^uintptr(0) >> handleIndexBits
+
+func (t *handleTable) slot(i uintptr) *handleSlot {
+	chunks, _ := t.chunks.Load().([]*handleChunk)
+	if i>>handleChunkBits >= uintptr(len(chunks)) {
+		return nil
+	}
+	return &chunks[i>>handleChunkBits][i&(handleChunkSize-1)]
+}
+
+// alloc stores v in a free slot and returns its handle.
+func (t *handleTable) alloc(v interface{}) uintptr {
+	for {
+		head := t.head.Load()
+		i := uintptr(uint32(head))
+		if i == 0 {
+			t.addChunk()
+			continue
+		}
+		s := t.slot(i - 1)
+		next := s.next.Load()
+		if t.head.CompareAndSwap(head, (head>>32+1)<<32|uint64(next)) {
+			gen := (uintptr(s.state.Load()>>slotStateBits) + 1) & handleGenMask
+			s.v = v
+			s.state.Store(uint64(gen)<<slotStateBits | slotLive)
+			return gen<<handleIndexBits | (i - 1)
+		}
+	}
+}
+
+// lookup returns the value of a live handle, or nil.
+func (t *handleTable) lookup(h uintptr) interface{} {
+	s := t.slot(h & handleIndexMask)
+	if s == nil {
+		return nil
+	}
+	live := uint64(h>>handleIndexBits)<<slotStateBits | slotLive
+	for {
+		st := s.state.Load()
+		if st&^slotBusy != live {
+			return nil
+		}
+		if st == live && s.state.CompareAndSwap(live, live|slotBusy) {
+			v := s.v
+			s.state.Store(live)
+			return v
+		}
+	}
+}
+
+// release frees a handle and returns its value. Only one of several
+// concurrent releases of the same handle gets the value, others get nil.
+func (t *handleTable) release(h uintptr) interface{} {
+	i := h & handleIndexMask
+	s := t.slot(i)
+	if s == nil {
+		return nil
+	}
+	gen := uint64(h>>handleIndexBits) << slotStateBits
+	live := gen | slotLive
+	for {
+		st := s.state.Load()
+		if st&^slotBusy != live {
+			return nil
+		}
+		if st == live && s.state.CompareAndSwap(live, gen) {
+			v := s.v
+			s.v = nil
+			t.push(i, s)
+			return v
+		}
+	}
+}
+
+func (t *handleTable) push(i uintptr, s *handleSlot) {
+	for {
+		head := t.head.Load()
+		s.next.Store(uint32(head))
+		if t.head.CompareAndSwap(head, (head>>32+1)<<32|uint64(i+1)) {
+			return
+		}
+	}
+}
+
+func (t *handleTable) addChunk() {
+	t.grow.Lock()
+	defer t.grow.Unlock()
+	if uint32(t.head.Load()) != 0 {
+		return
+	}
+	chunks, _ := t.chunks.Load().([]*handleChunk)
+	if len(chunks) == handleMaxChunks {
+		panic("webview: too many live handles")
+	}
+	c := &handleChunk{}
+	base := uintptr(len(chunks)) << handleChunkBits
+	t.chunks.Store(append(chunks[:len(chunks):len(chunks)], c))
+	for i := handleChunkSize - 1; i >= 0; i-- {
+		t.push(base+uintptr(i), &c[i])
+	}
+}
+
+// dispatchQueue batches dispatched functions, so that one cgo call wakes up
+// the main thread for all functions queued until it runs.
+type dispatchQueue struct {
+	mu        sync.Mutex
+	pending   []func()
+	running   []func() // Only touched by the main thread, reused
+	scheduled bool
+}
+
+// push queues f and reports whether the main thread has to be woken up.
+func (q *dispatchQueue) push(f func()) bool {
+	q.mu.Lock()
+	defer q.mu.Unlock()
+	q.pending = append(q.pending, f)
+	wake := !q.scheduled
+	q.scheduled = true
+	return wake
+}
+
+// drain runs the queued functions. Functions queued while they run go into
+// the next batch.
+func (q *dispatchQueue) drain() {
+	q.mu.Lock()
+	batch := q.pending
+	q.pending = q.running[:0]
+	q.running = nil // A nested main loop may drain again
+	q.scheduled = false
+	q.mu.Unlock()
+	for i, f := range batch {
+		batch[i] = nil
+		f()
+	}
+	q.running = batch
 }
 
 var (
-	m        sync.Mutex
-	index    uintptr
-	dispatch = map[uintptr]func(){}
-	bindings = map[uintptr]func(id, req string) (interface{}, error){}
+	viewsLock sync.Mutex
+	views     atomic.Value // map[C.webview_t]*webview, copied on write
 )
 
+func lookupView(w C.webview_t) *webview {
+	all, _ := views.Load().(map[C.webview_t]*webview)
+	return all[w]
+}
+
+func registerView(w C.webview_t, v *webview) {
+	viewsLock.Lock()
+	defer viewsLock.Unlock()
+	old, _ := views.Load().(map[C.webview_t]*webview)
+	all := make(map[C.webview_t]*webview, len(old)+1)
+	for k, x := range old {
+		all[k] = x
+	}
+	if v != nil {
+		all[w] = v
+	} else {
+		delete(all, w)
+	}
+	views.Store(all)
+}
+
 func boolToInt(b bool) C.int {
 	if b {
 		return 1
@@ -161,11 +449,21 @@ func New(width int, height int, hide bool, debug bool) WebView {
 
 	w := &webview{}
 	w.w = C.webview_create(C.int(width), C.int(height), boolToInt(hide), boolToInt(debug))
+	w.page, w.leave = context.WithCancel(context.Background())
+	w.slots = make(chan struct{}, defaultAsyncLimit)
+	w.calls = map[string]struct{}{}
+	registerView(w.w, w)
+	C.CgoWebViewOnPage(w.w)
 	return w
 }
 
 func (w *webview) Destroy() {
+	w.mu.Lock()
+	w.destroyed = true
+	w.leave()
+	w.mu.Unlock()
 	C.webview_destroy(w.w)
+	registerView(w.w, nil)
 }
 
 func (w *webview) Run() {
@@ -188,16 +486,25 @@ func (w *webview) Window() unsafe.Pointer {
 	return C.webview_get_window(w.w)
 }
 
+// cString passes the bytes of s to the _n functions of the C API, which copy
+// them before returning.
+func cString(s string) (*C.char, C.size_t) {
+	return (*C.char)(unsafe.Pointer(unsafe.StringData(s))), C.size_t(len(s))
+}
+
+func cBytes(b []byte) (*C.char, C.size_t) {
+	return (*C.char)(unsafe.Pointer(unsafe.SliceData(b))), C.size_t(len(b))
+}
+
 func (w *webview) Navigate(url string) {
-	s := C.CString(url)
-	defer C.free(unsafe.Pointer(s))
-	C.webview_navigate(w.w, s)
+	w.newPage(true)
+	s, n := cString(url)
+	C.webview_navigate_n(w.w, s, n)
 }
 
 func (w *webview) SetTitle(title string) {
-	s := C.CString(title)
-	defer C.free(unsafe.Pointer(s))
-	C.webview_set_title(w.w, s)
+	s, n := cString(title)
+	C.webview_set_title_n(w.w, s, n)
 }
 
 func (w *webview) SetSize(width int, height int, hint Hint) {
@@ -209,128 +516,436 @@ func (w *webview) SetIcon(iconBytes []byte) {
 }
 
 func (w *webview) Init(js string) {
-	s := C.CString(js)
-	defer C.free(unsafe.Pointer(s))
-	C.webview_init(w.w, s)
+	s, n := cString(js)
+	C.webview_init_n(w.w, s, n)
 }
 
 func (w *webview) Eval(js string) {
-	s := C.CString(js)
-	defer C.free(unsafe.Pointer(s))
-	C.webview_eval(w.w, s)
+	s, n := cString(js)
+	C.webview_eval_n(w.w, s, n)
 }
 
 func (w *webview) Dispatch(f func()) {
-	m.Lock()
-	for ; dispatch[index] != nil; index++ {
+	if w.dispatch.push(f) {
+		C.CgoWebViewDispatch(w.w)
 	}
-	dispatch[index] = f
-	m.Unlock()
-	C.CgoWebViewDispatch(w.w, C.uintptr_t(index))
 }
 
 //export _webviewDispatchGoCallback
-func _webviewDispatchGoCallback(index unsafe.Pointer) {
-	m.Lock()
-	f := dispatch[uintptr(index)]
-	delete(dispatch, uintptr(index))
-	m.Unlock()
-	f()
+func _webviewDispatchGoCallback(w C.webview_t) {
+	if v := lookupView(w); v != nil {
+		v.dispatch.drain()
+	}
+}
+
+// newPage cancels the contexts of async bindings called by the current page.
+// When the page is still there, i.e. before Navigate loads another one, its
+// unsettled calls are rejected. Pages loaded without Navigate, e.g. by a link
+// or a reload, are reported by the native webview once they replaced the old
+// one, where it supports it.
+func (w *webview) newPage(reject bool) {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	if reject {
+		for id := range w.calls {
+			w.reject(id, errPageLeft)
+		}
+	}
+	w.calls = map[string]struct{}{}
+	w.leave()
+	w.page, w.leave = context.WithCancel(context.Background())
+}
+
+//export _webviewPageGoCallback
+func _webviewPageGoCallback(w C.webview_t) {
+	if v := lookupView(w); v != nil {
+		v.newPage(false)
+	}
+}
+
+//export _webviewBindingGoFree
+func _webviewBindingGoFree(w C.webview_t, index uintptr) {
+	if v := lookupView(w); v != nil {
+		v.bindings.release(index)
+	}
 }
 
 //export _webviewBindingGoCallback
 func _webviewBindingGoCallback(w C.webview_t, id *C.char, req *C.char, index uintptr) {
-	m.Lock()
-	f := bindings[uintptr(index)]
-	m.Unlock()
-	jsString := func(v interface{}) string { b, _ := json.Marshal(v); return string(b) }
-	status, result := 0, ""
-	if res, err := f(C.GoString(id), C.GoString(req)); err != nil {
-		status = -1
-		result = jsString(err.Error())
-	} else if b, err := json.Marshal(res); err != nil {
+	v := lookupView(w)
+	if v == nil {
+		return
+	}
+	switch f := v.bindings.lookup(index).(type) {
+	case bindingFunc:
+		res, err := f(C.GoString(id), C.GoString(req))
+		v.resolve(id, res, err)
+	case asyncBinding:
+		v.runAsync(C.GoString(id), C.GoString(req), f)
+	}
+}
+
+// Buffers larger than this are left to the garbage collector instead of
+// being kept in the pool.
+const maxPooledResult = 1 << 20
+
+// resultBuffer keeps a JSON encoder writing into the buffer, so that both are
+// reused together.
+type resultBuffer struct {
+	bytes.Buffer
+	enc *json.Encoder
+}
+
+func newResultBuffer() *resultBuffer {
+	buf := &resultBuffer{}
+	buf.enc = json.NewEncoder(&buf.Buffer)
+	return buf
+}
+
+var resultBuffers = sync.Pool{New: func() interface{} { return newResultBuffer() }}
+
+func (w *webview) resolve(id *C.char, res interface{}, err error) {
+	buf := resultBuffers.Get().(*resultBuffer)
+	status := 0
+	if err == nil {
+		err = encodeResult(buf, res)
+	}
+	if err != nil {
 		status = -1
-		result = jsString(err.Error())
-	} else {
-		status = 0
-		result = string(b)
+		buf.Reset()
+		buf.enc.Encode(err.Error())
+	}
+	s, n := cBytes(buf.Bytes())
+	C.webview_return_n(w.w, id, C.int(status), s, n)
+	if buf.Cap() <= maxPooledResult {
+		buf.Reset()
+		resultBuffers.Put(buf)
+	}
+}
+
+// encodeResult writes the JSON of a binding result to buf. JS and
+// json.RawMessage results are already JSON and are written as they are.
+func encodeResult(buf *resultBuffer, res interface{}) error {
+	switch r := res.(type) {
+	case nil:
+		buf.WriteString("null")
+	case JS:
+		buf.Write(r)
+	case json.RawMessage:
+		buf.Write(r)
+	default:
+		return buf.enc.Encode(res)
+	}
+	return nil
+}
+
+func (w *webview) runAsync(id, req string, f asyncBinding) {
+	w.mu.Lock()
+	if w.waiting >= maxAsyncWaiting {
+		w.mu.Unlock()
+		w.reject(id, errAsyncSaturated)
+		return
+	}
+	w.waiting++
+	w.calls[id] = struct{}{}
+	ctx, slots := w.page, w.slots
+	w.mu.Unlock()
+	go func() {
+		waited := func() {
+			w.mu.Lock()
+			w.waiting--
+			w.mu.Unlock()
+		}
+		select {
+		case slots <- struct{}{}:
+			waited()
+		case <-ctx.Done():
+			waited()
+			return
+		}
+		res, err := f(ctx, req)
+		<-slots
+		w.mu.Lock()
+		defer w.mu.Unlock()
+		// Calls of a page that was left were rejected by Navigate, or went
+		// away with it. A new page may reuse their ids.
+		if w.destroyed || ctx.Err() != nil {
+			return
+		}
+		delete(w.calls, id)
+		cid := C.CString(id)
+		defer C.free(unsafe.Pointer(cid))
+		w.resolve(cid, res, err)
+	}()
+}
+
+func (w *webview) reject(id string, err error) {
+	cid := C.CString(id)
+	defer C.free(unsafe.Pointer(cid))
+	w.resolve(cid, nil, err)
+}
+
+func (w *webview) SetAsyncLimit(n int) {
+	if n < 1 {
+		n = 1
 	}
-	s := C.CString(result)
-	defer C.free(unsafe.Pointer(s))
-	C.webview_return(w, id, C.int(status), s)
+	w.mu.Lock()
+	w.slots = make(chan struct{}, n)
+	w.mu.Unlock()
 }
 
 func (w *webview) Bind(name string, f interface{}) error {
+	binding, err := newBinding(f)
+	if err != nil {
+		return err
+	}
+	w.bind(name, binding)
+	return nil
+}
+
+func (w *webview) BindAsync(name string, f interface{}) error {
+	p, err := newBindingPlan(f, true)
+	if err != nil {
+		return err
+	}
+	w.bind(name, asyncBinding(p.callAsync))
+	return nil
+}
+
+func (w *webview) SetBindingLimit(name string, limit int, policy Overflow) {
+	if limit < 0 {
+		limit = 0
+	}
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	C.webview_set_binding_limit(w.w, cname, C.size_t(limit), C.int(policy))
+}
+
+func (w *webview) Unbind(name string) {
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	C.webview_unbind(w.w, cname)
+}
+
+// bind hands the handle of f over to the C binding, which releases it when
+// the binding is replaced, removed or destroyed with the webview.
+func (w *webview) bind(name string, f interface{}) {
+	cname := C.CString(name)
+	defer C.free(unsafe.Pointer(cname))
+	C.CgoWebViewBind(w.w, cname, C.uintptr_t(w.bindings.alloc(f)))
+}
+
+var (
+	errorType   = reflect.TypeOf((*error)(nil)).Elem()
+	contextType = reflect.TypeOf((*context.Context)(nil)).Elem()
+)
+
+// bindingPlan is everything a binding call needs to know about the bound
+// function, worked out once by Bind.
+type bindingPlan struct {
+	fn       reflect.Value
+	args     []reflect.Type // Passed from JavaScript
+	context  bool           // A context.Context comes before args
+	variadic bool
+	value    bool // The first result is a value
+	errIndex int  // Index of the error result, or -1
+}
+
+func newBinding(f interface{}) (bindingFunc, error) {
+	p, err := newBindingPlan(f, false)
+	if err != nil {
+		return nil, err
+	}
+	return p.call, nil
+}
+
+func newBindingPlan(f interface{}, withContext bool) (*bindingPlan, error) {
 	v := reflect.ValueOf(f)
 	// f must be a function
 	if v.Kind() != reflect.Func {
-		return errors.New("only functions can be bound")
+		return nil, errors.New("only functions can be bound")
+	}
+	t := v.Type()
+	p := &bindingPlan{fn: v, context: withContext, variadic: t.IsVariadic(), errIndex: -1}
+	first := 0
+	if withContext {
+		if t.NumIn() == 0 || t.In(0) != contextType {
+			return nil, errors.New("first argument must be a context.Context")
+		}
+		first = 1
+	}
+	for i := first; i < t.NumIn(); i++ {
+		p.args = append(p.args, t.In(i))
 	}
 	// f must return either value and error or just error
-	if n := v.Type().NumOut(); n > 2 {
-		return errors.New("function may only return a value or a value+error")
+	switch t.NumOut() {
+	case 0:
+	case 1:
+		// One result may be a value, or an error
+		if t.Out(0).Implements(errorType) {
+			p.errIndex = 0
+		} else {
+			p.value = true
+		}
+	case 2:
+		// Two results: first one is value, second is error
+		if !t.Out(1).Implements(errorType) {
+			return nil, errors.New("second return value must be an error")
+		}
+		p.value = true
+		p.errIndex = 1
+	default:
+		return nil, errors.New("function may only return a value or a value+error")
 	}
+	return p, nil
+}
 
-	binding := func(id, req string) (interface{}, error) {
-		raw := []json.RawMessage{}
-		if err := json.Unmarshal([]byte(req), &raw); err != nil {
-			return nil, err
-		}
+func (p *bindingPlan) call(id, req string) (interface{}, error) {
+	return p.invoke(context.Background(), req)
+}
 
-		isVariadic := v.Type().IsVariadic()
-		numIn := v.Type().NumIn()
-		if (isVariadic && len(raw) < numIn-1) || (!isVariadic && len(raw) != numIn) {
-			return nil, errors.New("function arguments mismatch")
+func (p *bindingPlan) callAsync(ctx context.Context, req string) (interface{}, error) {
+	return p.invoke(ctx, req)
+}
+
+func (p *bindingPlan) invoke(ctx context.Context, req string) (interface{}, error) {
+	args, err := p.decode(req)
+	if err != nil {
+		return nil, err
+	}
+	if p.context {
+		args[0] = reflect.ValueOf(&ctx).Elem()
+	}
+	res := p.fn.Call(args)
+	if p.errIndex >= 0 {
+		if e := res[p.errIndex].Interface(); e != nil {
+			err = e.(error)
 		}
-		args := []reflect.Value{}
-		for i := range raw {
-			var arg reflect.Value
-			if isVariadic && i >= numIn-1 {
-				arg = reflect.New(v.Type().In(numIn - 1).Elem())
-			} else {
-				arg = reflect.New(v.Type().In(i))
-			}
-			if err := json.Unmarshal(raw[i], arg.Interface()); err != nil {
-				return nil, err
-			}
-			args = append(args, arg.Elem())
+	}
+	if p.value {
+		return res[0].Interface(), err
+	}
+	return nil, err
+}
+
+// decode unmarshals the JSON array of arguments straight into values of the
+// parameter types, in a single pass for non-variadic functions. The first
+// value is left for the context if the function takes one.
+func (p *bindingPlan) decode(req string) ([]reflect.Value, error) {
+	first := 0
+	if p.context {
+		first = 1
+	}
+	if p.variadic {
+		return p.decodeVariadic(req, first)
+	}
+	args := make([]reflect.Value, first+len(p.args))
+	ptrs := make([]interface{}, len(p.args))
+	for i, t := range p.args {
+		args[first+i] = reflect.New(t)
+		ptrs[i] = args[first+i].Interface()
+	}
+	if err := decodeArgs(req, ptrs); err != nil {
+		return nil, err
+	}
+	for i := first; i < len(args); i++ {
+		args[i] = args[i].Elem()
+	}
+	return args, nil
+}
+
+func (p *bindingPlan) decodeVariadic(req string, first int) ([]reflect.Value, error) {
+	raw := []json.RawMessage{}
+	if err := json.Unmarshal([]byte(req), &raw); err != nil {
+		return nil, err
+	}
+	numIn := len(p.args)
+	if len(raw) < numIn-1 {
+		return nil, errors.New("function arguments mismatch")
+	}
+	args := make([]reflect.Value, first, first+len(raw))
+	for i := range raw {
+		var arg reflect.Value
+		if i >= numIn-1 {
+			arg = reflect.New(p.args[numIn-1].Elem())
+		} else {
+			arg = reflect.New(p.args[i])
 		}
-		errorType := reflect.TypeOf((*error)(nil)).Elem()
-		res := v.Call(args)
-		switch len(res) {
-		case 0:
-			// No results from the function, just return nil
-			return nil, nil
-		case 1:
-			// One result may be a value, or an error
-			if res[0].Type().Implements(errorType) {
-				if res[0].Interface() != nil {
-					return nil, res[0].Interface().(error)
-				}
-				return nil, nil
-			}
-			return res[0].Interface(), nil
-		case 2:
-			// Two results: first one is value, second is error
-			if !res[1].Type().Implements(errorType) {
-				return nil, errors.New("second return value must be an error")
-			}
-			if res[1].Interface() == nil {
-				return res[0].Interface(), nil
-			}
-			return res[0].Interface(), res[1].Interface().(error)
-		default:
-			return nil, errors.New("unexpected number of return values")
+		if err := json.Unmarshal(raw[i], arg.Interface()); err != nil {
+			return nil, err
 		}
+		args = append(args, arg.Elem())
 	}
+	return args, nil
+}
 
-	m.Lock()
-	for ; bindings[index] != nil; index++ {
+// decodeArgs unmarshals a JSON array into the values ptrs point to. The
+// array must have exactly one element per pointer.
+func decodeArgs(req string, ptrs []interface{}) error {
+	n := len(ptrs)
+	if err := json.Unmarshal([]byte(req), &ptrs); err != nil {
+		return err
+	}
+	if len(ptrs) != n {
+		return errors.New("function arguments mismatch")
 	}
-	bindings[index] = binding
-	m.Unlock()
-	cname := C.CString(name)
-	defer C.free(unsafe.Pointer(cname))
-	C.CgoWebViewBind(w.w, cname, C.uintptr_t(index))
 	return nil
 }
+
+func bindTyped(w WebView, name string, f bindingFunc) error {
+	v, ok := w.(*webview)
+	if !ok {
+		return errors.New("typed bindings need a WebView created by New")
+	}
+	v.bind(name, f)
+	return nil
+}
+
+// Bind0 binds a function without arguments like Bind, but without going
+// through reflection on every call.
+func Bind0[R any](w WebView, name string, f func() (R, error)) error {
+	return bindTyped(w, name, binding0(f))
+}
+
+// Bind1 binds a function of one argument like Bind, but decodes the argument
+// into its static type without going through reflection on every call.
+func Bind1[A, R any](w WebView, name string, f func(A) (R, error)) error {
+	return bindTyped(w, name, binding1(f))
+}
+
+// Bind2 binds a function of two arguments like Bind, but decodes the
+// arguments into their static types without going through reflection on
+// every call.
+func Bind2[A, B, R any](w WebView, name string, f func(A, B) (R, error)) error {
+	return bindTyped(w, name, binding2(f))
+}
+
+func binding0[R any](f func() (R, error)) bindingFunc {
+	return func(id, req string) (interface{}, error) {
+		if err := decodeArgs(req, nil); err != nil {
+			return nil, err
+		}
+		return f()
+	}
+}
+
+func binding1[A, R any](f func(A) (R, error)) bindingFunc {
+	return func(id, req string) (interface{}, error) {
+		var a A
+		if err := decodeArgs(req, []interface{}{&a}); err != nil {
+			return nil, err
+		}
+		return f(a)
+	}
+}
+
+func binding2[A, B, R any](f func(A, B) (R, error)) bindingFunc {
+	return func(id, req string) (interface{}, error) {
+		var a A
+		var b B
+		if err := decodeArgs(req, []interface{}{&a, &b}); err != nil {
+			return nil, err
+		}
+		return f(a, b)
+	}
+}
@@ -28,11 +28,12 @@
 #define WEBVIEW_API extern
 #endif
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-
 typedef void *webview_t;
 
 // Creates a new webview instance. If debug is non-zero - developer tools will
@@ -54,6 +55,18 @@ WEBVIEW_API void webview_run(webview_t w);
 // background thread.
 WEBVIEW_API void webview_terminate(webview_t w);
 
+// Returns a file descriptor that becomes readable whenever the main loop has
+// work to do, so that the webview can be driven from an existing event loop
+// (epoll, libuv, ...) instead of webview_run(). Call webview_loop_iterate()
+// whenever it is readable. Returns -1 if the backend has no such descriptor.
+// Must be called from the thread that created the webview.
+WEBVIEW_API int webview_loop_fd(webview_t w);
+
+// Runs a single iteration of the main loop. If blocking is non-zero and there
+// is nothing to do, waits for the next event. Returns zero once the webview
+// was terminated, or if the backend cannot be driven this way.
+WEBVIEW_API int webview_loop_iterate(webview_t w, int blocking);
+
 //show webview window
 WEBVIEW_API void webview_show(webview_t w);
 
@@ -65,6 +78,115 @@ WEBVIEW_API void webview_hide(webview_t w);
 WEBVIEW_API void
 webview_dispatch(webview_t w, void (*fn)(webview_t w, void *arg), void *arg);
 
+// Runs a function on the main thread and waits until it has completed. When
+// called from the main thread the function runs immediately. Calling this from
+// a thread the main thread is waiting for will deadlock.
+WEBVIEW_API void webview_dispatch_sync(webview_t w,
+                                       void (*fn)(webview_t w, void *arg),
+                                       void *arg);
+
+// Posts a function to be executed on the main thread without waiting for it.
+// The value it returns is passed to done, which runs on the main thread right
+// after it. When called from the main thread both run before this function
+// returns.
+WEBVIEW_API void
+webview_dispatch_async(webview_t w, void *(*fn)(webview_t w, void *arg),
+                       void *arg,
+                       void (*done)(webview_t w, void *result, void *arg));
+
+// Returns non-zero if called from the thread that runs the main loop.
+WEBVIEW_API int webview_is_main_thread(webview_t w);
+
+// Dispatch priorities
+#define WEBVIEW_DISPATCH_INPUT 0      // Runs alongside native input events
+#define WEBVIEW_DISPATCH_NORMAL 1     // Same as webview_dispatch()
+#define WEBVIEW_DISPATCH_BACKGROUND 2 // Runs when nothing else is pending
+// Posts a function to be executed on the main thread with the given priority.
+// If key is not NULL and a function with the same key is still pending, that
+// function is replaced by this one instead of queueing another call; the
+// pending call keeps its original priority. Priorities other than the
+// WEBVIEW_DISPATCH constants are treated as WEBVIEW_DISPATCH_NORMAL.
+WEBVIEW_API void webview_dispatch_keyed(webview_t w, const char *key,
+                                        int priority,
+                                        void (*fn)(webview_t w, void *arg),
+                                        void *arg);
+
+// Limits how much main thread time dispatched functions may take per frame of
+// frame_us microseconds (16667 if zero). Once budget_us is used up, normal and
+// background dispatches wait for the next frame so that the UI can redraw. A
+// budget of zero disables the limit. Only the GTK backend honours the budget.
+// Must be called from the UI thread.
+WEBVIEW_API void webview_set_dispatch_budget(webview_t w, int budget_us,
+                                             int frame_us);
+
+// Counters describing how dispatched functions were scheduled.
+typedef struct {
+  unsigned long long executed;        // Dispatched functions that have run
+  unsigned long long coalesced;       // Keyed dispatches merged into another
+  unsigned long long deferred;        // Functions postponed by the budget
+  unsigned long long budget_overruns; // Functions that ran past the budget
+  unsigned long long native_stalls;   // Main thread tasks over the threshold
+  unsigned long long page_stalls;     // Times the web process hung
+} webview_stats_t;
+
+// Fills stats with the current counters. Safe to call from any thread.
+WEBVIEW_API void webview_get_stats(webview_t w, webview_stats_t *stats);
+
+// Share of wall-clock time, in percent, the main thread spent on each kind of
+// work. Nested work is only counted once, e.g. a binding that calls eval()
+// adds the eval time to eval and the rest to bindings.
+typedef struct {
+  double events;   // Native UI event processing
+  double dispatch; // Dispatched functions and timers
+  double bindings; // Binding handlers
+  double eval;     // Building and evaluating resolve/eval scripts
+} webview_utilization_t;
+
+// Fills the main thread utilization over the last second and the last minute.
+// Either pointer may be NULL. Safe to call from any thread.
+WEBVIEW_API void webview_get_utilization(webview_t w,
+                                         webview_utilization_t *last_second,
+                                         webview_utilization_t *last_minute);
+
+// Timer handle, zero is never a valid timer.
+typedef unsigned long long webview_timer_t;
+
+// Runs a function on the main thread once, ms milliseconds from now. Returns a
+// handle for webview_cancel_timer(), or zero if the backend has no timers.
+// Safe to call from any thread.
+WEBVIEW_API webview_timer_t
+webview_dispatch_after(webview_t w, int ms, void (*fn)(webview_t w, void *arg),
+                       void *arg);
+
+// Runs a function on the main thread every ms milliseconds until the timer is
+// cancelled. Returns zero if the backend has no timers.
+WEBVIEW_API webview_timer_t webview_every(webview_t w, int ms,
+                                          void (*fn)(webview_t w, void *arg),
+                                          void *arg);
+
+// Cancels a timer. Returns zero if it has already fired or was cancelled.
+WEBVIEW_API int webview_cancel_timer(webview_t w, webview_timer_t timer);
+
+// Allows timers to fire up to ms milliseconds late, so that nearby deadlines
+// share one wakeup of the main loop.
+WEBVIEW_API void webview_set_timer_tolerance(webview_t w, int ms);
+
+// Stall kinds
+#define WEBVIEW_STALL_NATIVE 0 // A native task blocked the main thread
+#define WEBVIEW_STALL_PAGE 1   // The web process stopped responding
+// Starts a watchdog thread that reports main thread tasks (dispatched
+// functions, binding calls, returned results) running longer than
+// threshold_ms. Name is the binding name or the kind of task. A native stall
+// is reported from the watchdog thread while it is still ongoing (finished is
+// zero) and from the main thread once it is over. Page stalls are reported
+// from the main thread when the web process stops and resumes responding. A
+// threshold of zero stops the watchdog.
+WEBVIEW_API void webview_set_watchdog(
+    webview_t w, int threshold_ms,
+    void (*fn)(webview_t w, int kind, const char *name, long long duration_ms,
+               int finished, void *arg),
+    void *arg);
+
 // Returns a native window handle pointer. When using GTK backend the pointer
 // is GtkWindow pointer, when using Cocoa backend the pointer is NSWindow
 // pointer, when using Win32 backend the pointer is HWND pointer.
@@ -72,6 +194,8 @@ WEBVIEW_API void *webview_get_window(webview_t w);
 
 // Updates the title of the native window. Must be called from the UI thread.
 WEBVIEW_API void webview_set_title(webview_t w, const char *title);
+WEBVIEW_API void webview_set_title_n(webview_t w, const char *title,
+                                     size_t len);
 
 // Window size hints
 #define WEBVIEW_HINT_NONE 0  // Width and height are default size
@@ -89,16 +213,55 @@ WEBVIEW_API void webview_set_icon(webview_t w, const void *icon,int size);
 // "data:text/text,<html>...</html>". It is often ok not to url-encode it
 // properly, webview will re-encode it for you.
 WEBVIEW_API void webview_navigate(webview_t w, const char *url);
+WEBVIEW_API void webview_navigate_n(webview_t w, const char *url, size_t len);
+
+// Calls fn on the main thread each time the webview commits a new document,
+// whether it was loaded by webview_navigate() or by the page itself, e.g. a
+// link or a reload. A NULL fn removes the callback. Only the GTK backend
+// reports page loads so far.
+WEBVIEW_API void webview_set_page_callback(webview_t w,
+                                           void (*fn)(webview_t w, void *arg),
+                                           void *arg);
 
 // Injects JavaScript code at the initialization of the new page. Every time
 // the webview will open a the new page - this initialization code will be
 // executed. It is guaranteed that code is executed before window.onload.
 WEBVIEW_API void webview_init(webview_t w, const char *js);
+WEBVIEW_API void webview_init_n(webview_t w, const char *js, size_t len);
+
+#define WEBVIEW_INJECT_DOCUMENT_START 0 // Before any script of the page
+#define WEBVIEW_INJECT_DOCUMENT_END 1   // Once the document is parsed
+// Same as webview_init(), but heavy scripts can be injected at the end of the
+// document so that they don't delay the first paint. Scripts with the same
+// source and injection point are injected only once. Bindings are usable
+// from every script. See WEBVIEW_INJECT constants.
+WEBVIEW_API void webview_init_at(webview_t w, const char *js, int at);
 
 // Evaluates arbitrary JavaScript code. Evaluation happens asynchronously, also
 // the result of the expression is ignored. Use RPC bindings if you want to
 // receive notifications about the results of the evaluation.
 WEBVIEW_API void webview_eval(webview_t w, const char *js);
+WEBVIEW_API void webview_eval_n(webview_t w, const char *js, size_t len);
+
+// Evaluates JavaScript code and calls fn on the main thread with the value of
+// its last expression serialized as JSON and error set to NULL, or with
+// result set to NULL and error set to the message of the exception it threw.
+// On WebKitGTK older than 2.28 the result is always "null".
+WEBVIEW_API void webview_eval_async(webview_t w, const char *js,
+                                    void (*fn)(const char *result,
+                                               const char *error, void *arg),
+                                    void *arg);
+
+// Registers the source of a JavaScript function, e.g. "function(a, b) {...}",
+// in the current page and in pages loaded later. Returns a handle for
+// webview_invoke().
+WEBVIEW_API int webview_prepare(webview_t w, const char *fn);
+
+// Calls a prepared function with args, a JSON array, without compiling its
+// source again. Calls made in a row are evaluated together, before the next
+// webview_eval() at the latest. May be called from any thread, calls from
+// other threads are queued with webview_dispatch().
+WEBVIEW_API void webview_invoke(webview_t w, int handle, const char *args);
 
 // Binds a native C callback so that it will appear under the given name as a
 // global JavaScript function. Internally it uses webview_init(). Callback
@@ -110,6 +273,29 @@ WEBVIEW_API void webview_bind(webview_t w, const char *name,
                                          void *arg),
                               void *arg);
 
+// Same as webview_bind(), but the webview owns arg: it is freed with free_arg
+// when the binding is replaced or removed, or when the webview is destroyed.
+WEBVIEW_API void webview_bind_owned(webview_t w, const char *name,
+                                    void (*fn)(const char *seq,
+                                               const char *req, void *arg),
+                                    void *arg, void (*free_arg)(void *arg));
+
+// Removes a binding, its JavaScript function and its init script.
+WEBVIEW_API void webview_unbind(webview_t w, const char *name);
+
+#define WEBVIEW_OVERFLOW_REJECT 0       // The new call is rejected
+#define WEBVIEW_OVERFLOW_DROP_OLDEST 1  // The oldest waiting call is rejected
+#define WEBVIEW_OVERFLOW_MERGE_LATEST 2 // The new call replaces the newest one
+// Bounds the number of calls of a binding that wait to run. With a limit,
+// calls no longer run as soon as they arrive but one at a time from the
+// dispatch queue, so a page calling in a tight loop can not starve the main
+// thread. Calls that don't fit reject with an Error named "SaturatedError",
+// see WEBVIEW_OVERFLOW constants. A limit of zero removes the bound. May be
+// called from any thread, the limit applies once the main thread gets to it.
+// Calls still waiting when the binding is removed are rejected.
+WEBVIEW_API void webview_set_binding_limit(webview_t w, const char *name,
+                                           size_t limit, int policy);
+
 // Allows to return a value from the native binding. Original request pointer
 // must be provided to help internal RPC engine match requests with responses.
 // If status is zero - result is expected to be a valid JSON result value.
@@ -117,6 +303,13 @@ WEBVIEW_API void webview_bind(webview_t w, const char *name,
 WEBVIEW_API void webview_return(webview_t w, const char *seq, int status,
                                 const char *result);
 
+// The _n variants take strings as a pointer and a length in bytes instead of
+// NUL-terminated. The bytes are copied before the call returns, so they can
+// point into memory the caller does not own, e.g. a Go string. Results passed
+// to webview_return_n() are copied only once, into the resolving script.
+WEBVIEW_API void webview_return_n(webview_t w, const char *seq, int status,
+                                  const char *result, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
@@ -135,18 +328,578 @@ WEBVIEW_API void webview_return(webview_t w, const char *seq, int status,
 #endif
 #endif
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <functional>
 #include <future>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
 #include <cstring>
 
 namespace webview {
-using dispatch_fn_t = std::function<void()>;
+
+// Thread-safe allocator for small objects. Blocks are carved out of chunks in
+// a few size classes and recycled through per-class free lists; memory is
+// only given back when the pool is destroyed. Requests larger than the
+// biggest class fall through to operator new.
+class slab_pool {
+public:
+  static const size_t max_block_size = 512;
+
+  slab_pool() = default;
+  slab_pool(const slab_pool &) = delete;
+  slab_pool &operator=(const slab_pool &) = delete;
+  ~slab_pool() {
+    for (auto &c : m_classes) {
+      for (auto chunk : c.chunks) {
+        ::operator delete(chunk);
+      }
+    }
+  }
+
+  void *allocate(size_t n) {
+    if (n > max_block_size) {
+      return ::operator new(n);
+    }
+    size_class &c = m_classes[class_of(n)];
+    std::lock_guard<std::mutex> lock(c.mutex);
+    if (c.free == nullptr) {
+      size_t block = block_size(class_of(n));
+      char *chunk = static_cast<char *>(::operator new(block * chunk_blocks));
+      c.chunks.push_back(chunk);
+      for (size_t i = 0; i < chunk_blocks; i++) {
+        auto b = reinterpret_cast<free_block *>(chunk + i * block);
+        b->next = c.free;
+        c.free = b;
+      }
+    }
+    free_block *b = c.free;
+    c.free = b->next;
+    return b;
+  }
+
+  void deallocate(void *p, size_t n) {
+    if (n > max_block_size) {
+      ::operator delete(p);
+      return;
+    }
+    size_class &c = m_classes[class_of(n)];
+    std::lock_guard<std::mutex> lock(c.mutex);
+    auto b = static_cast<free_block *>(p);
+    b->next = c.free;
+    c.free = b;
+  }
+
+private:
+  static const size_t min_block_size = 64;
+  static const size_t class_count = 4;
+  static const size_t chunk_blocks = 32;
+
+  static size_t block_size(size_t cls) { return min_block_size << cls; }
+  static size_t class_of(size_t n) {
+    size_t cls = 0;
+    while (block_size(cls) < n) {
+      cls++;
+    }
+    return cls;
+  }
+
+  struct free_block {
+    free_block *next;
+  };
+  struct size_class {
+    std::mutex mutex;
+    free_block *free = nullptr;
+    std::vector<char *> chunks;
+  };
+  size_class m_classes[class_count];
+};
+
+// Move-only counterpart of std::function. Callables up to inline_size bytes
+// are stored in place, larger ones are boxed in the given slab_pool (or on
+// the heap if no pool is given).
+template <typename Sig> class unique_function;
+
+template <typename R, typename... Args> class unique_function<R(Args...)> {
+public:
+  static const size_t inline_size = 5 * sizeof(void *);
+  static const size_t inline_align = alignof(void *);
+
+  unique_function() noexcept : m_ops(nullptr) {}
+  unique_function(std::nullptr_t) noexcept : m_ops(nullptr) {}
+
+  template <typename F,
+            typename = typename std::enable_if<!std::is_same<
+                typename std::decay<F>::type, unique_function>::value>::type>
+  unique_function(F &&f, slab_pool *pool = nullptr) : m_ops(nullptr) {
+    using T = typename std::decay<F>::type;
+    store<T>(std::forward<F>(f), pool,
+             std::integral_constant<bool, fits_inline<T>()>());
+  }
+
+  unique_function(unique_function &&other) noexcept : m_ops(other.m_ops) {
+    if (m_ops != nullptr) {
+      m_ops->move(&m_storage, &other.m_storage);
+      other.m_ops = nullptr;
+    }
+  }
+
+  unique_function &operator=(unique_function &&other) noexcept {
+    if (this != &other) {
+      reset();
+      if (other.m_ops != nullptr) {
+        m_ops = other.m_ops;
+        m_ops->move(&m_storage, &other.m_storage);
+        other.m_ops = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  unique_function &operator=(std::nullptr_t) noexcept {
+    reset();
+    return *this;
+  }
+
+  unique_function(const unique_function &) = delete;
+  unique_function &operator=(const unique_function &) = delete;
+
+  ~unique_function() { reset(); }
+
+  explicit operator bool() const noexcept { return m_ops != nullptr; }
+
+  R operator()(Args... args) {
+    return m_ops->invoke(&m_storage, std::forward<Args>(args)...);
+  }
+
+private:
+  struct ops_t {
+    R (*invoke)(void *, Args &&...);
+    void (*move)(void *, void *);
+    void (*destroy)(void *);
+  };
+
+  template <typename T> static constexpr bool fits_inline() {
+    return sizeof(T) <= inline_size && alignof(T) <= inline_align &&
+           std::is_nothrow_move_constructible<T>::value;
+  }
+
+  template <typename T> struct inline_ops {
+    static R invoke(void *p, Args &&... args) {
+      return (*static_cast<T *>(p))(std::forward<Args>(args)...);
+    }
+    static void move(void *dst, void *src) {
+      new (dst) T(std::move(*static_cast<T *>(src)));
+      static_cast<T *>(src)->~T();
+    }
+    static void destroy(void *p) { static_cast<T *>(p)->~T(); }
+  };
+
+  struct boxed {
+    void *ptr;
+    slab_pool *pool;
+  };
+
+  template <typename T> struct boxed_ops {
+    static R invoke(void *p, Args &&... args) {
+      return (*static_cast<T *>(static_cast<boxed *>(p)->ptr))(
+          std::forward<Args>(args)...);
+    }
+    static void move(void *dst, void *src) {
+      new (dst) boxed(*static_cast<boxed *>(src));
+    }
+    static void destroy(void *p) {
+      auto b = static_cast<boxed *>(p);
+      static_cast<T *>(b->ptr)->~T();
+      if (b->pool != nullptr) {
+        b->pool->deallocate(b->ptr, sizeof(T));
+      } else {
+        ::operator delete(b->ptr);
+      }
+    }
+  };
+
+  template <typename T, typename F>
+  void store(F &&f, slab_pool *, std::true_type) {
+    static const ops_t ops = {inline_ops<T>::invoke, inline_ops<T>::move,
+                              inline_ops<T>::destroy};
+    new (&m_storage) T(std::forward<F>(f));
+    m_ops = &ops;
+  }
+
+  template <typename T, typename F>
+  void store(F &&f, slab_pool *pool, std::false_type) {
+    static const ops_t ops = {boxed_ops<T>::invoke, boxed_ops<T>::move,
+                              boxed_ops<T>::destroy};
+    bool pooled = pool != nullptr && alignof(T) <= alignof(std::max_align_t);
+    void *p = pooled ? pool->allocate(sizeof(T)) : ::operator new(sizeof(T));
+    new (p) T(std::forward<F>(f));
+    new (&m_storage) boxed{p, pooled ? pool : nullptr};
+    m_ops = &ops;
+  }
+
+  void reset() noexcept {
+    if (m_ops != nullptr) {
+      m_ops->destroy(&m_storage);
+      m_ops = nullptr;
+    }
+  }
+
+  typename std::aligned_storage<inline_size, inline_align>::type m_storage;
+  const ops_t *m_ops;
+};
+
+using dispatch_fn_t = unique_function<void()>;
+
+// Receives the value of an evaluated script as JSON, or the message of the
+// exception it threw in error.
+using eval_callback_t = unique_function<void(std::string result,
+                                             std::string error)>;
+
+// Priority lanes for dispatched closures. Input-critical work runs alongside
+// native input events, normal work runs before redraws and background work
+// only runs when nothing else is pending.
+enum class dispatch_priority { input, normal, background };
+
+// Keeps track of the task currently running on the main thread: dispatched
+// closures, binding handlers and RPC results. Once started, a watchdog thread
+// reports tasks that run longer than the threshold while they are still
+// running, and again from the main thread when they finish. Page stalls are
+// reported by the backend through page_responsive().
+class task_monitor {
+public:
+  using stall_fn_t = std::function<void(int kind, const std::string &name,
+                                        long long duration_ms, bool finished)>;
+
+  // Marks the lifetime of a main thread task. Nested scopes only relabel
+  // the running task, its duration is measured by the outermost one.
+  class scope {
+  public:
+    scope(task_monitor &m, const char *name)
+        : m_monitor(m), m_active(m.m_enabled.load(std::memory_order_relaxed)) {
+      if (m_active) {
+        m_monitor.begin(name, m_outer);
+      }
+    }
+    ~scope() {
+      if (m_active) {
+        m_monitor.end(m_outer);
+      }
+    }
+    scope(const scope &) = delete;
+    scope &operator=(const scope &) = delete;
+
+  private:
+    task_monitor &m_monitor;
+    bool m_active;
+    std::string m_outer;
+  };
+
+  task_monitor() = default;
+  task_monitor(const task_monitor &) = delete;
+  task_monitor &operator=(const task_monitor &) = delete;
+  ~task_monitor() { stop(); }
+
+  // Starts the watchdog thread, a threshold of zero stops it.
+  void start(int threshold_ms, stall_fn_t fn) {
+    stop();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_fn = std::move(fn);
+    if (threshold_ms <= 0) {
+      return;
+    }
+    m_threshold = std::chrono::milliseconds(threshold_ms);
+    m_quit = false;
+    m_enabled = true;
+    m_thread = std::thread(&task_monitor::watch, this);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_enabled = false;
+      m_quit = true;
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable()) {
+      m_thread.join();
+    }
+  }
+
+  // Called by the backend on the main thread whenever the web process stops
+  // or resumes responding.
+  void page_responsive(bool responsive) {
+    auto now = clock::now();
+    stall_fn_t fn;
+    long long ms = 0;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (responsive == !m_page_stalled) {
+        return;
+      }
+      m_page_stalled = !responsive;
+      if (m_page_stalled) {
+        m_page_stall_start = now;
+        m_page_stalls.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        ms = to_ms(now - m_page_stall_start);
+      }
+      fn = m_fn;
+    }
+    if (fn) {
+      fn(WEBVIEW_STALL_PAGE, "", ms, responsive);
+    }
+  }
+
+  uint64_t native_stalls() const {
+    return m_native_stalls.load(std::memory_order_relaxed);
+  }
+  uint64_t page_stalls() const {
+    return m_page_stalls.load(std::memory_order_relaxed);
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  static long long to_ms(clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+  }
+
+  void begin(const char *name, std::string &outer) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_depth++ > 0) {
+      outer.swap(m_name);
+      m_name = name;
+      return;
+    }
+    m_name = name;
+    m_start = clock::now();
+    m_reported = false;
+  }
+
+  void end(std::string &outer) {
+    stall_fn_t fn;
+    std::string name;
+    long long ms;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (--m_depth > 0) {
+        m_name.swap(outer);
+        return;
+      }
+      auto d = clock::now() - m_start;
+      if (d <= m_threshold) {
+        return;
+      }
+      if (!m_reported) {
+        m_native_stalls.fetch_add(1, std::memory_order_relaxed);
+      }
+      fn = m_fn;
+      name = m_name;
+      ms = to_ms(d);
+    }
+    if (fn) {
+      fn(WEBVIEW_STALL_NATIVE, name, ms, true);
+    }
+  }
+
+  void watch() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_quit) {
+      m_cv.wait_for(lock, m_threshold / 4);
+      if (m_quit || m_depth == 0 || m_reported) {
+        continue;
+      }
+      auto d = clock::now() - m_start;
+      if (d > m_threshold) {
+        m_reported = true;
+        m_native_stalls.fetch_add(1, std::memory_order_relaxed);
+        stall_fn_t fn = m_fn;
+        std::string name = m_name;
+        lock.unlock();
+        if (fn) {
+          fn(WEBVIEW_STALL_NATIVE, name, to_ms(d), false);
+        }
+        lock.lock();
+      }
+    }
+  }
+
+  std::atomic<bool> m_enabled{false};
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::thread m_thread;
+  bool m_quit = false;
+  stall_fn_t m_fn;
+  clock::duration m_threshold = clock::duration::max();
+  int m_depth = 0;
+  std::string m_name;
+  clock::time_point m_start;
+  bool m_reported = false;
+  bool m_page_stalled = false;
+  clock::time_point m_page_stall_start;
+  std::atomic<uint64_t> m_native_stalls{0};
+  std::atomic<uint64_t> m_page_stalls{0};
+};
+
+enum class main_activity { events, dispatch, bindings, eval };
+
+// Where an init script runs in a new page.
+enum class inject_at { document_start, document_end };
+
+// What happens to a binding call that arrives while the queue of the binding
+// is full.
+enum class overflow_policy { reject, drop_oldest, merge_latest };
+
+// Accounts main thread time per activity in 100ms slots covering the last
+// minute. Only the main thread enters scopes, any thread may read.
+class load_meter {
+public:
+  // Charges the time until it is destroyed, minus nested scopes, to an
+  // activity. An inactive scope charges nothing.
+  class scope {
+  public:
+    scope(load_meter &m, main_activity a, bool active = true)
+        : m_meter(active ? &m : nullptr),
+          m_outer(active ? m.enter(static_cast<int>(a)) : -1) {}
+    ~scope() {
+      if (m_meter) {
+        m_meter->leave(m_outer);
+      }
+    }
+    scope(const scope &) = delete;
+    scope &operator=(const scope &) = delete;
+
+  private:
+    load_meter *m_meter;
+    int m_outer;
+  };
+
+  load_meter() : m_epoch(clock::now()), m_slots(slot_count) {}
+  load_meter(const load_meter &) = delete;
+
+  // Same as a scope, for activities that start and end in different
+  // callbacks. Pass the result of begin() to end().
+  int begin(main_activity a) { return enter(static_cast<int>(a)); }
+  void end(int outer) { leave(outer); }
+
+  load_meter &operator=(const load_meter &) = delete;
+
+  void utilization(webview_utilization_t *last_second,
+                   webview_utilization_t *last_minute) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto now = clock::now();
+    // Count the running activity too, so that a stuck main thread shows up.
+    if (m_current >= 0) {
+      charge(m_current, m_mark, now);
+      m_mark = now;
+    }
+    fill(last_second, 10, now);
+    fill(last_minute, slot_count, now);
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+  enum { activity_count = 4, slot_count = 600 };
+
+  struct slot {
+    long long id = -1;
+    clock::rep busy[activity_count] = {};
+  };
+
+  static clock::duration slot_span() { return std::chrono::milliseconds(100); }
+
+  int enter(int activity) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto now = clock::now();
+    int outer = m_current;
+    if (outer >= 0) {
+      charge(outer, m_mark, now);
+    }
+    m_current = activity;
+    m_mark = now;
+    return outer;
+  }
+
+  void leave(int outer) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto now = clock::now();
+    charge(m_current, m_mark, now);
+    m_current = outer;
+    m_mark = now;
+  }
+
+  long long slot_id(clock::time_point t) const {
+    return (t - m_epoch) / slot_span();
+  }
+
+  slot &slot_at(long long id) {
+    auto &s = m_slots[id % slot_count];
+    if (s.id != id) {
+      s = slot();
+      s.id = id;
+    }
+    return s;
+  }
+
+  // Splits the interval over the slots it covers.
+  void charge(int activity, clock::time_point from, clock::time_point to) {
+    if (to - from > slot_span() * slot_count) {
+      from = to - slot_span() * slot_count;
+    }
+    while (from < to) {
+      auto id = slot_id(from);
+      auto until = std::min<clock::time_point>(
+          to, m_epoch + slot_span() * (id + 1));
+      slot_at(id).busy[activity] += (until - from).count();
+      from = until;
+    }
+  }
+
+  void fill(webview_utilization_t *u, int slots, clock::time_point now) {
+    if (u == nullptr) {
+      return;
+    }
+    auto last = slot_id(now);
+    auto first = std::max(0LL, last - slots + 1);
+    clock::rep busy[activity_count] = {};
+    for (auto id = first; id <= last; id++) {
+      auto &s = m_slots[id % slot_count];
+      if (s.id == id) {
+        for (int a = 0; a < activity_count; a++) {
+          busy[a] += s.busy[a];
+        }
+      }
+    }
+    auto span = (now - (m_epoch + slot_span() * first)).count();
+    double scale = span > 0 ? 100.0 / span : 0;
+    u->events = busy[static_cast<int>(main_activity::events)] * scale;
+    u->dispatch = busy[static_cast<int>(main_activity::dispatch)] * scale;
+    u->bindings = busy[static_cast<int>(main_activity::bindings)] * scale;
+    u->eval = busy[static_cast<int>(main_activity::eval)] * scale;
+  }
+
+  std::mutex m_mutex;
+  clock::time_point m_epoch;
+  std::vector<slot> m_slots;
+  int m_current = -1;
+  clock::time_point m_mark;
+};
 
 // Convert ASCII hex digit to a nibble (four bits, 0 - 15).
 //
@@ -169,22 +922,23 @@ static inline char hex2char(const char *p) {
   return hex2nibble(p[0]) * 16 + hex2nibble(p[1]);
 }
 
-inline std::string url_encode(const std::string s) {
+inline std::string url_encode(const std::string &s) {
   std::string encoded;
+  encoded.reserve(s.length());
   for (unsigned int i = 0; i < s.length(); i++) {
     auto c = s[i];
     if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
-      encoded = encoded + c;
+      encoded.push_back(c);
     } else {
       char hex[4];
       snprintf(hex, sizeof(hex), "%%%02x", c);
-      encoded = encoded + hex;
+      encoded.append(hex);
     }
   }
   return encoded;
 }
 
-inline std::string url_decode(const std::string st) {
+inline std::string url_decode(const std::string &st) {
   std::string decoded;
   const char *s = st.c_str();
   size_t length = strlen(s);
@@ -201,13 +955,34 @@ inline std::string url_decode(const std::string st) {
   return decoded;
 }
 
-inline std::string html_from_uri(const std::string s) {
-  if (s.substr(0, 15) == "data:text/html,") {
+inline std::string html_from_uri(const std::string &s) {
+  if (s.compare(0, 15, "data:text/html,") == 0) {
     return url_decode(s.substr(15));
   }
   return "";
 }
 
+// Returns 32 hex digits from the system's random source, for ids the page
+// must not be able to guess.
+inline std::string random_token() {
+  static const char digits[] = "0123456789abcdef";
+  std::random_device random;
+  std::string token;
+  for (int i = 0; i < 4; i++) {
+    uint32_t r = random();
+    for (int j = 0; j < 8; j++, r >>= 4) {
+      token += digits[r & 0xf];
+    }
+  }
+  return token;
+}
+
+// Strings passed to the _n functions of the C API, a null pointer is only
+// valid with a zero length.
+inline std::string string_n(const char *s, size_t len) {
+  return len > 0 ? std::string(s, len) : std::string();
+}
+
 inline int json_parse_c(const char *s, size_t sz, const char *key, size_t keysz,
                         const char **value, size_t *valuesz) {
   enum {
@@ -347,9 +1122,97 @@ inline int json_parse_c(const char *s, size_t sz, const char *key, size_t keysz,
   return -1;
 }
 
+// Quotes s as a JSON string, which is also a valid JavaScript string
+// literal: U+2028 and U+2029 are escaped as well.
 inline std::string json_escape(std::string s) {
-  // TODO: implement
-  return '"' + s + '"';
+  static const char hex[] = "0123456789abcdef";
+  std::string r;
+  r.reserve(s.size() + 2);
+  r += '"';
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char c = s[i];
+    switch (c) {
+    case '"':
+      r += "\\\"";
+      break;
+    case '\\':
+      r += "\\\\";
+      break;
+    case '\b':
+      r += "\\b";
+      break;
+    case '\f':
+      r += "\\f";
+      break;
+    case '\n':
+      r += "\\n";
+      break;
+    case '\r':
+      r += "\\r";
+      break;
+    case '\t':
+      r += "\\t";
+      break;
+    default:
+      if (c < 0x20) {
+        r += "\\u00";
+        r += hex[c >> 4];
+        r += hex[c & 0xf];
+      } else if (c == 0xe2 && i + 2 < s.size() &&
+                 static_cast<unsigned char>(s[i + 1]) == 0x80 &&
+                 (static_cast<unsigned char>(s[i + 2]) & 0xfe) == 0xa8) {
+        r += static_cast<unsigned char>(s[i + 2]) == 0xa8 ? "\\u2028"
+                                                          : "\\u2029";
+        i += 2;
+      } else {
+        r += static_cast<char>(c);
+      }
+    }
+  }
+  r += '"';
+  return r;
+}
+
+// Value of four hex digits, or -1.
+inline long json_hex4(const char *s) {
+  long v = 0;
+  for (int i = 0; i < 4; i++) {
+    unsigned char c = s[i];
+    if (hex2nibble(c) == 0 && c != '0') {
+      return -1;
+    }
+    v = v * 16 + hex2nibble(c);
+  }
+  return v;
+}
+
+// Writes code point cp as UTF-8 to out, if not NULL, and returns its length.
+inline int utf8_encode(unsigned long cp, char *out) {
+  char buf[4];
+  int len;
+  if (cp < 0x80) {
+    buf[0] = static_cast<char>(cp);
+    len = 1;
+  } else if (cp < 0x800) {
+    buf[0] = static_cast<char>(0xc0 | (cp >> 6));
+    buf[1] = static_cast<char>(0x80 | (cp & 0x3f));
+    len = 2;
+  } else if (cp < 0x10000) {
+    buf[0] = static_cast<char>(0xe0 | (cp >> 12));
+    buf[1] = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+    buf[2] = static_cast<char>(0x80 | (cp & 0x3f));
+    len = 3;
+  } else {
+    buf[0] = static_cast<char>(0xf0 | (cp >> 18));
+    buf[1] = static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+    buf[2] = static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+    buf[3] = static_cast<char>(0x80 | (cp & 0x3f));
+    len = 4;
+  }
+  if (out != NULL) {
+    memcpy(out, buf, len);
+  }
+  return len;
 }
 
 inline int json_unescape(const char *s, size_t n, char *out) {
@@ -387,7 +1250,33 @@ inline int json_unescape(const char *s, size_t n, char *out) {
       case '\"':
         c = '\"';
         break;
-      default: // TODO: support unicode decoding
+      case 'u': {
+        long cp = n >= 7 ? json_hex4(s + 1) : -1;
+        if (cp < 0) {
+          return -1;
+        }
+        s += 5;
+        n -= 5;
+        if (cp >= 0xd800 && cp < 0xe000) {
+          // A surrogate pair, lone surrogates become U+FFFD.
+          long low = n >= 8 && s[0] == '\\' && s[1] == 'u' ? json_hex4(s + 2)
+                                                            : -1;
+          if (cp < 0xdc00 && low >= 0xdc00 && low < 0xe000) {
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            s += 6;
+            n -= 6;
+          } else {
+            cp = 0xfffd;
+          }
+        }
+        int len = utf8_encode(cp, out);
+        if (out != NULL) {
+          out += len;
+        }
+        r += len;
+        continue;
+      }
+      default:
         return -1;
       }
     }
@@ -433,6 +1322,88 @@ inline std::string json_parse(const std::string s, const std::string key,
   return "";
 }
 
+// Intrusive multi-producer single-consumer queue (D. Vyukov). push() is
+// wait-free and may be called from any thread, pop() and empty() must only be
+// called from the single consumer thread.
+//
+// pop() may transiently report an empty queue while a producer is half-way
+// through push(); callers are expected to have that producer signal them once
+// its push() has returned. Nodes come from the given slab_pool, if any.
+template <typename T> class mpsc_queue {
+public:
+  explicit mpsc_queue(slab_pool *pool = nullptr)
+      : m_head(&m_stub), m_tail(&m_stub), m_pool(pool) {}
+  mpsc_queue(const mpsc_queue &) = delete;
+  mpsc_queue &operator=(const mpsc_queue &) = delete;
+  ~mpsc_queue() {
+    T value;
+    while (pop(value)) {
+    }
+  }
+
+  void push(T value) {
+    void *p = m_pool != nullptr ? m_pool->allocate(sizeof(node))
+                                : ::operator new(sizeof(node));
+    push_node(new (p) node(std::move(value)));
+  }
+
+  bool pop(T &value) {
+    node *tail = m_tail;
+    node *next = tail->next.load(std::memory_order_acquire);
+    if (tail == &m_stub) {
+      if (next == nullptr) {
+        return false;
+      }
+      m_tail = next;
+      tail = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+    if (next == nullptr) {
+      if (tail != m_head.load(std::memory_order_acquire)) {
+        return false;
+      }
+      push_node(&m_stub);
+      next = tail->next.load(std::memory_order_acquire);
+      if (next == nullptr) {
+        return false;
+      }
+    }
+    m_tail = next;
+    value = std::move(tail->value);
+    tail->~node();
+    if (m_pool != nullptr) {
+      m_pool->deallocate(tail, sizeof(node));
+    } else {
+      ::operator delete(tail);
+    }
+    return true;
+  }
+
+  bool empty() const {
+    return m_tail == &m_stub &&
+           m_stub.next.load(std::memory_order_acquire) == nullptr;
+  }
+
+private:
+  struct node {
+    node() : next(nullptr) {}
+    explicit node(T v) : next(nullptr), value(std::move(v)) {}
+    std::atomic<node *> next;
+    T value;
+  };
+
+  void push_node(node *n) {
+    n->next.store(nullptr, std::memory_order_relaxed);
+    node *prev = m_head.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+  }
+
+  std::atomic<node *> m_head;
+  node *m_tail;
+  node m_stub;
+  slab_pool *m_pool;
+};
+
 } // namespace webview
 
 #if defined(WEBVIEW_GTK)
@@ -456,7 +1427,78 @@ public:
   webview(int width,int height,bool hide = false,bool debug = false)
       : browser_engine(width,height,hide,debug) {}
 
-  void navigate(const std::string url) {
+  using browser_engine::dispatch;
+
+  // Coalescing dispatch: while a closure posted with the same key is still
+  // pending, it is replaced by f instead of queueing another call.
+  template <typename F>
+  void dispatch(const std::string &key, dispatch_priority priority, F &&f) {
+    dispatch_fn_t replaced;
+    {
+      std::lock_guard<std::mutex> lock(m_keyed_mutex);
+      auto it = m_keyed.find(key);
+      if (it != m_keyed.end()) {
+        m_coalesced.fetch_add(1, std::memory_order_relaxed);
+        replaced = std::move(it->second);
+        it->second = dispatch_fn_t(std::forward<F>(f));
+        return;
+      }
+      m_keyed.emplace(key, dispatch_fn_t(std::forward<F>(f)));
+    }
+    dispatch(priority, keyed_task{this, key});
+  }
+
+  // Runs f on the main thread and returns a future for its result. On the
+  // main thread f runs inline and the returned future is already ready.
+  template <typename F>
+  auto dispatch_async(F f) -> std::future<decltype(f())> {
+    std::packaged_task<decltype(f())()> task(std::move(f));
+    auto result = task.get_future();
+    if (is_main_thread()) {
+      task();
+    } else {
+      dispatch(std::move(task));
+    }
+    return result;
+  }
+
+  // Runs f on the main thread and waits for its result. On the main thread f
+  // runs inline. Must not be called from a thread that the main thread waits
+  // for, and the main loop must be running to make progress.
+  template <typename F> auto dispatch_sync(F f) -> decltype(f()) {
+    if (is_main_thread()) {
+      return f();
+    }
+    return dispatch_async(std::move(f)).get();
+  }
+
+  webview_stats_t stats() {
+    webview_stats_t s = browser_engine::stats();
+    s.coalesced = m_coalesced.load(std::memory_order_relaxed);
+    s.native_stalls = m_monitor.native_stalls();
+    s.page_stalls = m_monitor.page_stalls();
+    return s;
+  }
+
+  // See webview_set_watchdog().
+  void set_watchdog(int threshold_ms, task_monitor::stall_fn_t fn) {
+    m_monitor.start(threshold_ms, std::move(fn));
+  }
+
+  // See webview_get_utilization().
+  void utilization(webview_utilization_t *last_second,
+                   webview_utilization_t *last_minute) {
+    m_load.utilization(last_second, last_minute);
+  }
+
+  using page_fn_t = unique_function<void()>;
+
+  // Calls fn on the main thread each time a new document is committed, see
+  // webview_set_page_callback().
+  void on_page(page_fn_t fn) { m_page_fn = std::move(fn); }
+
+  void navigate(const std::string &url) {
+    flush_bootstrap();
     if (url == "") {
       browser_engine::navigate("data:text/html," +
                                url_encode("<html><body>Hello</body></html>"));
@@ -470,69 +1512,564 @@ public:
     }
   }
 
-  using binding_t = std::function<void(std::string, std::string, void *)>;
-  using binding_ctx_t = std::pair<binding_t *, void *>;
+  using binding_t = unique_function<void(std::string, std::string, void *)>;
+  using sync_binding_t = unique_function<std::string(std::string)>;
+
+  // Everything a binding owns, released when it is unbound or the webview is
+  // destroyed.
+  struct binding_ctx_t {
+    binding_ctx_t(binding_t f, void *arg, void (*free_arg)(void *))
+        : fn(std::move(f)), arg(arg), owned(free_arg ? arg : nullptr,
+                                             free_arg ? free_arg : noop) {}
+    static void noop(void *) {}
+    binding_t fn;
+    void *arg;
+    std::unique_ptr<void, void (*)(void *)> owned;
+  };
+
+  // Adds js to pages loaded from now on and returns an id for uninit().
+  // Scripts with the same source and injection point are added once and
+  // removed with the last uninit().
+  int init(const std::string &js, inject_at at = inject_at::document_start) {
+    // Keeps bindings usable from scripts added after them.
+    flush_bootstrap();
+    auto key = std::make_pair(at, js);
+    auto it = m_user_scripts.find(key);
+    if (it != m_user_scripts.end()) {
+      it->second.refs++;
+      return it->second.id;
+    }
+    int id = ++m_last_script;
+    m_user_scripts[key] = user_script{id, browser_engine::init(js, at), 1};
+    return id;
+  }
+
+  void uninit(int id) {
+    for (auto it = m_user_scripts.begin(); it != m_user_scripts.end(); ++it) {
+      if (it->second.id == id) {
+        if (--it->second.refs == 0) {
+          browser_engine::uninit(it->second.engine_id);
+          m_user_scripts.erase(it);
+        }
+        return;
+      }
+    }
+  }
+
+  void bind(const std::string &name, sync_binding_t fn) {
+    bind(name, sync_binding{this, std::move(fn)}, nullptr);
+  }
 
-  using sync_binding_t = std::function<std::string(std::string)>;
-  using sync_binding_ctx_t = std::pair<webview *, sync_binding_t>;
+  void bind(const std::string &name, binding_t f, void *arg,
+            void (*free_arg)(void *) = nullptr) {
+    // A binding that is replaced keeps its JavaScript function in the
+    // current page, calls go to the new one.
+    auto &ctx = bindings[name];
+    bool added = !ctx;
+    ctx = std::make_shared<binding_ctx_t>(std::move(f), arg, free_arg);
+    if (added) {
+      invalidate_bootstrap();
+    }
+  }
 
-  void bind(const std::string name, sync_binding_t fn) {
-    bind(
-        name,
-        [](std::string seq, std::string req, void *arg) {
-          auto pair = static_cast<sync_binding_ctx_t *>(arg);
-          pair->first->resolve(seq, 0, pair->second(req));
-        },
-        new sync_binding_ctx_t(this, fn));
+  void unbind(const std::string &name) {
+    auto it = bindings.find(name);
+    if (it == bindings.end()) {
+      return;
+    }
+    bindings.erase(it);
+    invalidate_bootstrap();
+    eval("delete window[" + json_escape(name) + "]");
+    auto in = m_inbound.find(name);
+    if (in != m_inbound.end()) {
+      auto calls = std::move(in->second.calls);
+      m_inbound.erase(in);
+      for (auto &call : calls) {
+        resolve(call.first, 1, json_escape(name + " was unbound"));
+      }
+    }
   }
 
-  void bind(const std::string name, binding_t f, void *arg) {
-    auto js = "(function() { var name = '" + name + "';" + R"(
-      var RPC = window._rpc = (window._rpc || {nextSeq: 1});
-      window[name] = function() {
-        var seq = RPC.nextSeq++;
-        var promise = new Promise(function(resolve, reject) {
-          RPC[seq] = {
-            resolve: resolve,
-            reject: reject,
-          };
-        });
-        window.external.invoke(JSON.stringify({
-          id: seq,
-          method: name,
-          params: Array.prototype.slice.call(arguments),
-        }));
-        return promise;
-      }
-    })())";
+  // See webview_set_binding_limit().
+  void set_binding_limit(const std::string &name, size_t limit,
+                         overflow_policy policy = overflow_policy::reject) {
+    if (!is_main_thread()) {
+      dispatch(binding_limit_task{this, name, limit, policy});
+      return;
+    }
+    if (limit == 0) {
+      auto it = m_inbound.find(name);
+      if (it != m_inbound.end() && it->second.calls.empty() &&
+          !it->second.scheduled) {
+        m_inbound.erase(it);
+      } else if (it != m_inbound.end()) {
+        it->second.limit = SIZE_MAX;
+      }
+      return;
+    }
+    inbound &in = m_inbound[name];
+    in.limit = limit;
+    in.policy = policy;
+  }
+
+  // Registers fn, the source of a JavaScript function, in the current page
+  // and in pages loaded later. Returns a handle for invoke().
+  int prepare(const std::string &fn) {
+    auto js = "(window._fn = window._fn || {})[" +
+              std::to_string(++m_last_prepared) + "] = (" + fn + ");";
     init(js);
-    bindings[name] = new binding_ctx_t(new binding_t(f), arg);
+    eval(js);
+    return m_last_prepared;
   }
 
-  void resolve(const std::string seq, int status, const std::string result) {
-    dispatch([=]() {
-      if (status == 0) {
-        eval("window._rpc[" + seq + "].resolve(" + result + "); window._rpc[" +
-             seq + "] = undefined");
+  // Calls a prepared function with args, a JSON array, without compiling it
+  // again. Calls are evaluated together on the next turn of the main loop,
+  // or before the next eval(). Calls from other threads join the batch from
+  // the dispatch queue, in the order they were made.
+  void invoke(int handle, const std::string &args) {
+    if (!is_main_thread()) {
+      dispatch(invoke_task{this, handle, args});
+      return;
+    }
+    if (m_batch.empty()) {
+      dispatch(flush_batch_task{this});
+    }
+    m_batch.append("try { window._fn[").append(std::to_string(handle));
+    m_batch.append("].apply(null, ").append(args);
+    m_batch.append("); } catch (e) { console.error(e); }\n");
+  }
+
+  void eval(const std::string &js) {
+    flush_batch();
+    browser_engine::eval(js);
+  }
+
+  // Evaluates js and passes its result to fn on the main thread. The result
+  // is read natively, in a single round trip to the page. May be called from
+  // any thread.
+  void eval_async(const std::string &js, eval_callback_t fn) {
+    if (!is_main_thread()) {
+      dispatch(eval_async_task{this, js, std::move(fn)});
+      return;
+    }
+    flush_batch();
+    browser_engine::eval_async(js, std::move(fn));
+  }
+
+  // Same as above, the future throws std::runtime_error with the exception
+  // message if the script threw. Must not be waited for on the main thread.
+  std::future<std::string> eval_async(const std::string &js) {
+    eval_promise fn;
+    auto result = fn.promise.get_future();
+    eval_async(js, std::move(fn));
+    return result;
+  }
+
+  void resolve(const std::string &seq, int status, const std::string &result) {
+    resolve(seq, status, result.data(), result.size());
+  }
+
+  void resolve(const std::string &seq, int status, const char *result,
+               size_t len) {
+    // The script is built on the calling thread so that the closure only
+    // carries one string and fits into dispatch_fn_t's inline storage. The
+    // result is copied straight into it.
+    bool main = is_main_thread();
+#if defined(WEBVIEW_CALL_RESOLVER) || defined(WEBVIEW_RESULT_SCHEME)
+    if (len >= large_result_size) {
+      large_result_task task{this, seq, status, std::string(result, len)};
+      if (main) {
+        task();
       } else {
-        eval("window._rpc[" + seq + "].reject(" + result + "); window._rpc[" +
-             seq + "] = undefined");
+        dispatch(std::move(task));
       }
-    });
+      return;
+    }
+#endif
+    eval_task task{this, ""};
+    {
+      load_meter::scope building(m_load, main_activity::eval, main);
+      static const char resolve_js[] = "resolve(", reject_js[] = "reject(";
+      std::string &js = task.js;
+      js.reserve(2 * seq.size() + len + 64);
+      js.append("window._rpc[").append(seq).append("].");
+      js.append(status == 0 ? resolve_js : reject_js);
+      js.append(result, len);
+      js.append("); window._rpc[").append(seq).append("] = undefined");
+    }
+    // Synchronous bindings resolve from within on_message(), there is no
+    // need for a round trip through the dispatch queue.
+    if (main) {
+      task();
+      return;
+    }
+    dispatch(std::move(task));
+  }
+
+protected:
+  // Called on the main thread once a new document replaces the previous
+  // one. Only the GTK backend reports page loads.
+  virtual void on_page_committed() {
+    if (m_page_fn) {
+      m_page_fn();
+    }
   }
 
 private:
+  struct sync_binding {
+    webview *w;
+    sync_binding_t fn;
+    void operator()(std::string seq, std::string req, void *) {
+      w->resolve(seq, 0, fn(req));
+    }
+  };
+
+  // All bindings are installed by one init script, rebuilt once after a
+  // series of bind() and unbind() calls: before the next navigate() or init(),
+  // or on the next turn of the main loop.
+  void invalidate_bootstrap() {
+    if (!m_bootstrap_dirty) {
+      m_bootstrap_dirty = true;
+      dispatch(flush_bootstrap_task{this});
+    }
+  }
+
+  struct eval_async_task {
+    webview *w;
+    std::string js;
+    eval_callback_t fn;
+    void operator()() { w->eval_async(js, std::move(fn)); }
+  };
+
+  struct eval_promise {
+    std::promise<std::string> promise;
+    void operator()(std::string result, std::string error) {
+      if (error.empty()) {
+        promise.set_value(result);
+      } else {
+        promise.set_exception(
+            std::make_exception_ptr(std::runtime_error(error)));
+      }
+    }
+  };
+
+  struct flush_batch_task {
+    webview *w;
+    void operator()() { w->flush_batch(); }
+  };
+
+  struct binding_limit_task {
+    webview *w;
+    std::string name;
+    size_t limit;
+    overflow_policy policy;
+    void operator()() { w->set_binding_limit(name, limit, policy); }
+  };
+
+  struct invoke_task {
+    webview *w;
+    int handle;
+    std::string args;
+    void operator()() { w->invoke(handle, args); }
+  };
+
+  void flush_batch() {
+    if (m_batch.empty()) {
+      return;
+    }
+    task_monitor::scope task(m_monitor, "invoke");
+    load_meter::scope load(m_load, main_activity::eval);
+    std::string js;
+    js.swap(m_batch);
+    browser_engine::eval(js);
+  }
+
+  struct flush_bootstrap_task {
+    webview *w;
+    void operator()() { w->flush_bootstrap(); }
+  };
+
+  void flush_bootstrap() {
+    if (!m_bootstrap_dirty) {
+      return;
+    }
+    m_bootstrap_dirty = false;
+    if (m_bootstrap != 0) {
+      browser_engine::uninit(m_bootstrap);
+      m_bootstrap = 0;
+    }
+    if (bindings.empty()) {
+      return;
+    }
+    // Scripts run in the order they were added and user scripts may call
+    // bindings, so they are added again after the new bootstrap.
+    std::vector<user_scripts_t::iterator> scripts;
+    for (auto it = m_user_scripts.begin(); it != m_user_scripts.end(); ++it) {
+      browser_engine::uninit(it->second.engine_id);
+      scripts.push_back(it);
+    }
+    std::sort(scripts.begin(), scripts.end(),
+              [](user_scripts_t::iterator a, user_scripts_t::iterator b) {
+                return a->second.id < b->second.id;
+              });
+    std::string names;
+    for (auto &b : bindings) {
+      names += (names.empty() ? "" : ",") + json_escape(b.first);
+    }
+    // Functions are created on first access, so a page pays only for the
+    // bindings it uses.
+    m_bootstrap = browser_engine::init(R"((function() {
+      var RPC = window._rpc = (window._rpc || {nextSeq: 1});
+      RPC.settle = function(seq, status, result) {
+        var call = RPC[seq];
+        RPC[seq] = undefined;
+        if (status === 0) {
+          call.resolve(JSON.parse(result));
+        } else {
+          call.reject(JSON.parse(result));
+        }
+      };
+      RPC.fetch = function(seq, status, token) {
+        var call = RPC[seq];
+        fetch('webview-rpc://result/' + token).then(function(response) {
+          RPC[seq] = undefined;
+          return response.json().then(
+              status === 0 ? call.resolve : call.reject, call.reject);
+        }, function() {
+          // Pages that may not load the scheme get the result inline.
+          window.external.invoke(JSON.stringify({
+            id: seq, method: '_webview_result', params: [token],
+          }));
+        });
+      };
+      function define(name, value) {
+        Object.defineProperty(window, name, {
+          value: value, writable: true, configurable: true, enumerable: true,
+        });
+      }
+      function stub(name) {
+        return function() {
+          var seq = RPC.nextSeq++;
+          var promise = new Promise(function(resolve, reject) {
+            RPC[seq] = {
+              resolve: resolve,
+              reject: reject,
+            };
+          });
+          window.external.invoke(JSON.stringify({
+            id: seq,
+            method: name,
+            params: Array.prototype.slice.call(arguments),
+          }));
+          return promise;
+        };
+      }
+      [)" + names + R"(].forEach(function(name) {
+        Object.defineProperty(window, name, {
+          configurable: true,
+          enumerable: true,
+          get: function() {
+            var fn = stub(name);
+            define(name, fn);
+            return fn;
+          },
+          set: function(value) { define(name, value); },
+        });
+      });
+    })())");
+    for (auto it : scripts) {
+      it->second.engine_id = browser_engine::init(it->first.second,
+                                                  it->first.first);
+    }
+  }
+
+  struct user_script {
+    int id;
+    int engine_id;
+    int refs;
+  };
+  // Keyed by injection point and source.
+  using user_scripts_t =
+      std::map<std::pair<inject_at, std::string>, user_script>;
+
+  struct keyed_task {
+    webview *w;
+    std::string key;
+    void operator()() {
+      dispatch_fn_t f;
+      {
+        std::lock_guard<std::mutex> lock(w->m_keyed_mutex);
+        auto it = w->m_keyed.find(key);
+        f = std::move(it->second);
+        w->m_keyed.erase(it);
+      }
+      f();
+    }
+  };
+
+  struct eval_task {
+    webview *w;
+    std::string js;
+    void operator()() {
+      task_monitor::scope task(w->m_monitor, "resolve");
+      load_meter::scope load(w->m_load, main_activity::eval);
+      w->eval(js);
+    }
+  };
+
+#if defined(WEBVIEW_RESULT_SCHEME)
+  // Results from this size on are parked natively and fetched by the page,
+  // which parses the response body without ever holding it as a string.
+  static const size_t parked_result_size = 1024 * 1024;
+#endif
+
+#if defined(WEBVIEW_CALL_RESOLVER)
+  // Results from this size on are passed to the page as a function argument
+  // instead of being pasted into a script. Smaller ones stay inline, where
+  // building the script is cheaper than marshalling the call.
+  static const size_t large_result_size = 64 * 1024;
+#elif defined(WEBVIEW_RESULT_SCHEME)
+  static const size_t large_result_size = parked_result_size;
+#endif
+
+#if defined(WEBVIEW_CALL_RESOLVER) || defined(WEBVIEW_RESULT_SCHEME)
+  struct large_result_task {
+    webview *w;
+    std::string seq;
+    int status;
+    std::string result;
+    void operator()() {
+      task_monitor::scope task(w->m_monitor, "resolve");
+      load_meter::scope load(w->m_load, main_activity::eval);
+      // Calls invoked before the result must still run before it.
+      w->flush_batch();
+#if defined(WEBVIEW_RESULT_SCHEME)
+      if (result.size() >= parked_result_size) {
+        auto token = w->park_result(seq, status, std::move(result));
+        w->eval("window._rpc.fetch(" + seq + ", " + std::to_string(status) +
+                ", '" + token + "')");
+        return;
+      }
+#endif
+#if defined(WEBVIEW_CALL_RESOLVER)
+      w->call_resolver(seq, status, std::move(result));
+#endif
+    }
+  };
+#endif
+
   void on_message(const std::string msg) {
     auto seq = json_parse(msg, "id", 0);
     auto name = json_parse(msg, "method", 0);
     auto args = json_parse(msg, "params", 0);
-    if (bindings.find(name) == bindings.end()) {
+#if defined(WEBVIEW_RESULT_SCHEME)
+    if (name == "_webview_result") {
+      flush_batch();
+      unpark_result(json_parse(args, "", 0));
+      return;
+    }
+#endif
+    auto in = m_inbound.find(name);
+    if (in == m_inbound.end()) {
+      call_binding(name, seq, args);
       return;
     }
-    auto fn = bindings[name];
-    (*fn->first)(seq, args, fn->second);
+    enqueue_call(name, in->second, std::move(seq), std::move(args));
+  }
+
+  void call_binding(const std::string &name, const std::string &seq,
+                    const std::string &args) {
+    auto it = bindings.find(name);
+    if (it == bindings.end()) {
+      return;
+    }
+    // Keeps the binding alive if it unbinds itself.
+    auto ctx = it->second;
+    task_monitor::scope task(m_monitor, name.c_str());
+    load_meter::scope load(m_load, main_activity::bindings);
+    ctx->fn(seq, args, ctx->arg);
+  }
+
+  // Calls of a binding with a limit, waiting to run. Only touched on the
+  // main thread.
+  struct inbound {
+    size_t limit = SIZE_MAX;
+    overflow_policy policy = overflow_policy::reject;
+    std::deque<std::pair<std::string, std::string>> calls; // seq, args
+    bool scheduled = false;
+  };
+
+  void enqueue_call(const std::string &name, inbound &in, std::string seq,
+                    std::string args) {
+    if (in.calls.size() >= in.limit) {
+      switch (in.policy) {
+      case overflow_policy::reject:
+        reject_saturated(name, seq, in);
+        return;
+      case overflow_policy::drop_oldest:
+        reject_saturated(name, in.calls.front().first, in);
+        in.calls.pop_front();
+        break;
+      case overflow_policy::merge_latest:
+        reject_saturated(name, in.calls.back().first, in);
+        in.calls.pop_back();
+        break;
+      }
+    }
+    in.calls.emplace_back(std::move(seq), std::move(args));
+    if (!in.scheduled) {
+      in.scheduled = true;
+      dispatch(inbound_task{this, name});
+    }
+  }
+
+  void reject_saturated(const std::string &name, const std::string &seq,
+                        const inbound &in) {
+    resolve(seq, 1,
+            "Object.assign(new Error(" + json_escape(name + " is saturated") +
+                "), {name: 'SaturatedError', pending: " +
+                std::to_string(in.calls.size()) + "})");
   }
-  std::map<std::string, binding_ctx_t *> bindings;
+
+  // Runs the oldest waiting call of a binding and yields to the main loop
+  // before the next one.
+  struct inbound_task {
+    webview *w;
+    std::string name;
+    void operator()() {
+      auto it = w->m_inbound.find(name);
+      if (it == w->m_inbound.end()) {
+        return;
+      }
+      if (it->second.calls.empty()) {
+        it->second.scheduled = false;
+        return;
+      }
+      auto call = std::move(it->second.calls.front());
+      it->second.calls.pop_front();
+      if (!it->second.calls.empty()) {
+        w->dispatch(inbound_task{w, name});
+      } else if (it->second.limit == SIZE_MAX) {
+        // The limit was removed while calls were waiting.
+        w->m_inbound.erase(it);
+      } else {
+        it->second.scheduled = false;
+      }
+      w->call_binding(name, call.first, call.second);
+    }
+  };
+  std::map<std::string, std::shared_ptr<binding_ctx_t>> bindings;
+  user_scripts_t m_user_scripts;
+  int m_last_script = 0;
+  std::map<std::string, inbound> m_inbound;
+  page_fn_t m_page_fn;
+  int m_bootstrap = 0;
+  bool m_bootstrap_dirty = false;
+  int m_last_prepared = 0;
+  std::string m_batch; // Pending invoke() calls
+  std::mutex m_keyed_mutex;
+  std::map<std::string, dispatch_fn_t> m_keyed;
+  std::atomic<uint64_t> m_coalesced{0};
 };
 } // namespace webview
 
@@ -552,6 +2089,14 @@ WEBVIEW_API void webview_terminate(webview_t w) {
   static_cast<webview::webview *>(w)->terminate();
 }
 
+WEBVIEW_API int webview_loop_fd(webview_t w) {
+  return static_cast<webview::webview *>(w)->loop_fd();
+}
+
+WEBVIEW_API int webview_loop_iterate(webview_t w, int blocking) {
+  return static_cast<webview::webview *>(w)->loop_iterate(blocking != 0);
+}
+
 WEBVIEW_API void webview_show(webview_t w) {
   static_cast<webview::webview *>(w)->show();
 }
@@ -565,6 +2110,99 @@ WEBVIEW_API void webview_dispatch(webview_t w, void (*fn)(webview_t, void *),
   static_cast<webview::webview *>(w)->dispatch([=]() { fn(w, arg); });
 }
 
+WEBVIEW_API void webview_dispatch_sync(webview_t w,
+                                       void (*fn)(webview_t, void *),
+                                       void *arg) {
+  static_cast<webview::webview *>(w)->dispatch_sync([=]() { fn(w, arg); });
+}
+
+WEBVIEW_API void
+webview_dispatch_async(webview_t w, void *(*fn)(webview_t, void *), void *arg,
+                       void (*done)(webview_t, void *, void *)) {
+  auto task = [=]() {
+    void *result = fn(w, arg);
+    if (done != nullptr) {
+      done(w, result, arg);
+    }
+  };
+  if (webview_is_main_thread(w)) {
+    task();
+  } else {
+    static_cast<webview::webview *>(w)->dispatch(task);
+  }
+}
+
+WEBVIEW_API int webview_is_main_thread(webview_t w) {
+  return static_cast<webview::webview *>(w)->is_main_thread();
+}
+
+WEBVIEW_API void webview_dispatch_keyed(webview_t w, const char *key,
+                                        int priority,
+                                        void (*fn)(webview_t, void *),
+                                        void *arg) {
+  if (priority < WEBVIEW_DISPATCH_INPUT ||
+      priority > WEBVIEW_DISPATCH_BACKGROUND) {
+    priority = WEBVIEW_DISPATCH_NORMAL;
+  }
+  auto p = static_cast<webview::dispatch_priority>(priority);
+  if (key == nullptr) {
+    static_cast<webview::webview *>(w)->dispatch(p, [=]() { fn(w, arg); });
+  } else {
+    static_cast<webview::webview *>(w)->dispatch(key, p,
+                                                 [=]() { fn(w, arg); });
+  }
+}
+
+WEBVIEW_API webview_timer_t webview_dispatch_after(webview_t w, int ms,
+                                                  void (*fn)(webview_t, void *),
+                                                  void *arg) {
+  return static_cast<webview::webview *>(w)->dispatch_after(
+      ms, [=]() { fn(w, arg); });
+}
+
+WEBVIEW_API webview_timer_t webview_every(webview_t w, int ms,
+                                          void (*fn)(webview_t, void *),
+                                          void *arg) {
+  return static_cast<webview::webview *>(w)->every(ms,
+                                                   [=]() { fn(w, arg); });
+}
+
+WEBVIEW_API int webview_cancel_timer(webview_t w, webview_timer_t timer) {
+  return static_cast<webview::webview *>(w)->cancel_timer(timer);
+}
+
+WEBVIEW_API void webview_set_timer_tolerance(webview_t w, int ms) {
+  static_cast<webview::webview *>(w)->set_timer_tolerance(ms);
+}
+
+WEBVIEW_API void webview_set_dispatch_budget(webview_t w, int budget_us,
+                                             int frame_us) {
+  static_cast<webview::webview *>(w)->set_dispatch_budget(budget_us, frame_us);
+}
+
+WEBVIEW_API void webview_get_stats(webview_t w, webview_stats_t *stats) {
+  *stats = static_cast<webview::webview *>(w)->stats();
+}
+
+WEBVIEW_API void webview_get_utilization(webview_t w,
+                                         webview_utilization_t *last_second,
+                                         webview_utilization_t *last_minute) {
+  static_cast<webview::webview *>(w)->utilization(last_second, last_minute);
+}
+
+WEBVIEW_API void webview_set_watchdog(
+    webview_t w, int threshold_ms,
+    void (*fn)(webview_t, int, const char *, long long, int, void *),
+    void *arg) {
+  webview::task_monitor::stall_fn_t cb;
+  if (fn != nullptr) {
+    cb = [=](int kind, const std::string &name, long long ms, bool finished) {
+      fn(w, kind, name.c_str(), ms, finished, arg);
+    };
+  }
+  static_cast<webview::webview *>(w)->set_watchdog(threshold_ms, cb);
+}
+
 WEBVIEW_API void *webview_get_window(webview_t w) {
   return static_cast<webview::webview *>(w)->window();
 }
@@ -573,6 +2211,11 @@ WEBVIEW_API void webview_set_title(webview_t w, const char *title) {
   static_cast<webview::webview *>(w)->set_title(title);
 }
 
+WEBVIEW_API void webview_set_title_n(webview_t w, const char *title,
+                                     size_t len) {
+  static_cast<webview::webview *>(w)->set_title(webview::string_n(title, len));
+}
+
 WEBVIEW_API void webview_set_icon(webview_t w, const void *icon,int size) {
   static_cast<webview::webview *>(w)->set_icon(std::string((char*)icon,size));
 }
@@ -586,14 +2229,65 @@ WEBVIEW_API void webview_navigate(webview_t w, const char *url) {
   static_cast<webview::webview *>(w)->navigate(url);
 }
 
+WEBVIEW_API void webview_navigate_n(webview_t w, const char *url, size_t len) {
+  static_cast<webview::webview *>(w)->navigate(webview::string_n(url, len));
+}
+
+WEBVIEW_API void webview_set_page_callback(webview_t w,
+                                           void (*fn)(webview_t w, void *arg),
+                                           void *arg) {
+  webview::webview::page_fn_t page;
+  if (fn) {
+    page = [=]() { fn(w, arg); };
+  }
+  static_cast<webview::webview *>(w)->on_page(std::move(page));
+}
+
 WEBVIEW_API void webview_init(webview_t w, const char *js) {
   static_cast<webview::webview *>(w)->init(js);
 }
 
+WEBVIEW_API void webview_init_n(webview_t w, const char *js, size_t len) {
+  static_cast<webview::webview *>(w)->init(webview::string_n(js, len));
+}
+
+WEBVIEW_API void webview_init_at(webview_t w, const char *js, int at) {
+  auto where = at == WEBVIEW_INJECT_DOCUMENT_END
+                   ? webview::inject_at::document_end
+                   : webview::inject_at::document_start;
+  static_cast<webview::webview *>(w)->init(js, where);
+}
+
 WEBVIEW_API void webview_eval(webview_t w, const char *js) {
   static_cast<webview::webview *>(w)->eval(js);
 }
 
+WEBVIEW_API void webview_eval_n(webview_t w, const char *js, size_t len) {
+  static_cast<webview::webview *>(w)->eval(webview::string_n(js, len));
+}
+
+WEBVIEW_API void webview_eval_async(webview_t w, const char *js,
+                                    void (*fn)(const char *result,
+                                               const char *error, void *arg),
+                                    void *arg) {
+  static_cast<webview::webview *>(w)->eval_async(
+      js, [=](std::string result, std::string error) {
+        if (error.empty()) {
+          fn(result.c_str(), nullptr, arg);
+        } else {
+          fn(nullptr, error.c_str(), arg);
+        }
+      });
+}
+
+WEBVIEW_API int webview_prepare(webview_t w, const char *fn) {
+  return static_cast<webview::webview *>(w)->prepare(fn);
+}
+
+WEBVIEW_API void webview_invoke(webview_t w, int handle, const char *args) {
+  static_cast<webview::webview *>(w)->invoke(handle, args);
+}
+
 WEBVIEW_API void webview_bind(webview_t w, const char *name,
                               void (*fn)(const char *seq, const char *req,
                                          void *arg),
@@ -606,11 +2300,42 @@ WEBVIEW_API void webview_bind(webview_t w, const char *name,
       arg);
 }
 
+WEBVIEW_API void webview_bind_owned(webview_t w, const char *name,
+                                    void (*fn)(const char *seq,
+                                               const char *req, void *arg),
+                                    void *arg, void (*free_arg)(void *arg)) {
+  static_cast<webview::webview *>(w)->bind(
+      name,
+      [=](std::string seq, std::string req, void *arg) {
+        fn(seq.c_str(), req.c_str(), arg);
+      },
+      arg, free_arg);
+}
+
+WEBVIEW_API void webview_unbind(webview_t w, const char *name) {
+  static_cast<webview::webview *>(w)->unbind(name);
+}
+
+WEBVIEW_API void webview_set_binding_limit(webview_t w, const char *name,
+                                           size_t limit, int policy) {
+  auto p = policy == WEBVIEW_OVERFLOW_DROP_OLDEST
+               ? webview::overflow_policy::drop_oldest
+           : policy == WEBVIEW_OVERFLOW_MERGE_LATEST
+               ? webview::overflow_policy::merge_latest
+               : webview::overflow_policy::reject;
+  static_cast<webview::webview *>(w)->set_binding_limit(name, limit, p);
+}
+
 WEBVIEW_API void webview_return(webview_t w, const char *seq, int status,
                                 const char *result) {
   static_cast<webview::webview *>(w)->resolve(seq, status, result);
 }
 
+WEBVIEW_API void webview_return_n(webview_t w, const char *seq, int status,
+                                  const char *result, size_t len) {
+  static_cast<webview::webview *>(w)->resolve(seq, status, result, len);
+}
+
 #endif /* WEBVIEW_HEADER */
 
 #endif /* WEBVIEW_H */
@@ -0,0 +1,167 @@
+//bin/echo; [ $(uname) = "Darwin" ] && FLAGS="-framework Webkit" || FLAGS="$(pkg-config --cflags --libs gtk+-3.0 webkit2gtk-4.0)" ; c++ "$0" $FLAGS -std=c++11 -O2 -pthread -o webview_bench && ./webview_bench ; exit
+// +build ignore
+
+#include "webview.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+using bench_clock = std::chrono::steady_clock;
+
+static double elapsed_us(bench_clock::time_point since) {
+  return std::chrono::duration<double, std::micro>(bench_clock::now() - since)
+      .count();
+}
+
+#if defined(WEBVIEW_GTK)
+// The dispatch path as it was before the shared queue: one heap-allocated
+// std::function and one idle GSource per call.
+static void legacy_dispatch(webview::webview &, std::function<void()> f) {
+  g_idle_add_full(G_PRIORITY_HIGH_IDLE, (GSourceFunc)([](void *f) -> int {
+                    (*static_cast<std::function<void()> *>(f))();
+                    return G_SOURCE_REMOVE;
+                  }),
+                  new std::function<void()>(f), [](void *f) {
+                    delete static_cast<std::function<void()> *>(f);
+                  });
+}
+#endif
+
+static void queue_dispatch(webview::webview &w, std::function<void()> f) {
+  w.dispatch(f);
+}
+
+using dispatch_impl = void (*)(webview::webview &, std::function<void()>);
+
+// =================================================================
+// BENCH: closures per second posted from N threads until all of them
+// have run on the main thread.
+// =================================================================
+static void bench_throughput(dispatch_impl dispatch) {
+  const int threads = 4;
+  const int per_thread = 100000;
+  webview::webview w(480, 320);
+  int remaining = threads * per_thread;
+  auto start = bench_clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&]() {
+      for (int i = 0; i < per_thread; i++) {
+        dispatch(w, [&]() {
+          if (--remaining == 0) {
+            w.terminate();
+          }
+        });
+      }
+    });
+  }
+  w.run();
+  double us = elapsed_us(start);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  std::cout << "  " << threads * per_thread << " closures in " << us / 1000
+            << " ms, " << (threads * per_thread) / (us / 1e6) << " ops/s"
+            << std::endl;
+}
+
+// =================================================================
+// BENCH: time from dispatch() on an idle worker until the closure
+// starts running on the main thread.
+// =================================================================
+static void bench_latency(dispatch_impl dispatch) {
+  const int samples = 2000;
+  webview::webview w(480, 320);
+  std::vector<double> latencies;
+  std::thread worker([&]() {
+    for (int i = 0; i < samples; i++) {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+      std::promise<double> done;
+      auto start = bench_clock::now();
+      dispatch(w, [&]() { done.set_value(elapsed_us(start)); });
+      latencies.push_back(done.get_future().get());
+    }
+    w.dispatch([&]() { w.terminate(); });
+  });
+  w.run();
+  worker.join();
+  std::sort(latencies.begin(), latencies.end());
+  std::cout << "  p50 " << latencies[samples / 2] << " us, p99 "
+            << latencies[samples * 99 / 100] << " us" << std::endl;
+}
+
+// =================================================================
+// BENCH: round trip of a binding call from JavaScript until its promise
+// settles, resolved either by a synchronous binding on the main thread
+// or by a worker thread.
+// =================================================================
+static void bench_rpc(bool from_worker) {
+  webview::webview w(480, 320);
+  void (*ping)(std::string, std::string, void *) =
+      [](std::string seq, std::string req, void *arg) {
+        static_cast<webview::webview *>(arg)->resolve(seq, 0, req);
+      };
+  if (from_worker) {
+    ping = [](std::string seq, std::string req, void *arg) {
+      auto w = static_cast<webview::webview *>(arg);
+      std::thread([=]() { w->resolve(seq, 0, req); }).detach();
+    };
+  }
+  w.bind("ping", ping, &w);
+  w.bind("report", [&](std::string req) -> std::string {
+    std::cout << "  p50 " << webview::json_parse(req, "", 0) << " us, p99 "
+              << webview::json_parse(req, "", 1) << " us" << std::endl;
+    w.terminate();
+    return "";
+  });
+  w.init(R"(
+    window.addEventListener('load', async function() {
+      var samples = [];
+      for (var i = 0; i < 2100; i++) {
+        var start = performance.now();
+        await window.ping(i);
+        if (i >= 100) {
+          samples.push((performance.now() - start) * 1000);
+        }
+      }
+      samples.sort(function(a, b) { return a - b; });
+      window.report(samples[samples.length >> 1],
+                    samples[Math.floor(samples.length * 0.99)]);
+    });
+  )");
+  w.navigate("data:text/html,%3Chtml%3Ebench%3C%2Fhtml%3E");
+  w.run();
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::pair<std::string, std::function<void()>>> all_benches = {
+      {"dispatch_throughput", [] { bench_throughput(queue_dispatch); }},
+      {"dispatch_latency", [] { bench_latency(queue_dispatch); }},
+      {"rpc_roundtrip", [] { bench_rpc(false); }},
+      {"rpc_roundtrip_worker", [] { bench_rpc(true); }},
+#if defined(WEBVIEW_GTK)
+      {"legacy_dispatch_throughput", [] { bench_throughput(legacy_dispatch); }},
+      {"legacy_dispatch_latency", [] { bench_latency(legacy_dispatch); }},
+#endif
+  };
+  int ran = 0;
+  for (auto &bench : all_benches) {
+    if (argc == 2 && bench.first != argv[1]) {
+      continue;
+    }
+    std::cout << "BENCH: " << bench.first << std::endl;
+    bench.second();
+    ran++;
+  }
+  if (ran == 0) {
+    std::cout << "USAGE: " << argv[0] << " [bench name]" << std::endl;
+    std::cout << "Benchmarks: " << std::endl;
+    for (auto &bench : all_benches) {
+      std::cout << "  " << bench.first << std::endl;
+    }
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,358 @@
+//
+// ====================================================================
+//
+// Optional C++20 coroutine layer on top of webview.h. Native logic that
+// spans several steps in the page can be written as one coroutine instead
+// of nested dispatch() callbacks and binding round trips:
+//
+//   webview::task<std::string> flow(webview::coro_webview &w,
+//                                   std::string req) {
+//     co_await w.on_main();
+//     auto title = co_await w.eval_async("document.title");
+//     co_return co_await w.call_js("confirmTitle", "[" + title + "]");
+//   }
+//   ...
+//   w.bind_coro("flow", flow);
+//
+// ====================================================================
+//
+
+#ifndef WEBVIEW_CORO_H
+#define WEBVIEW_CORO_H
+
+#include "webview.h"
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace webview {
+
+class coro_webview;
+
+namespace detail {
+
+// Coroutine frames that take a coro_webview as their first parameter, or as
+// the first one after the closure of a lambda, come from the pool of that
+// webview. Others come from the heap. A header in front of each frame tells
+// where it has to go back to.
+struct frame_alloc {
+  struct header {
+    slab_pool *pool;
+    size_t size;
+  };
+  static const size_t header_size = 16;
+  static_assert(sizeof(header) <= header_size, "frame header too large");
+
+  static void *allocate(slab_pool *pool, size_t n) {
+    void *p = pool ? pool->allocate(n + header_size)
+                   : ::operator new(n + header_size);
+    *static_cast<header *>(p) = header{pool, n + header_size};
+    return static_cast<char *>(p) + header_size;
+  }
+
+  static void release(void *p) {
+    char *block = static_cast<char *>(p) - header_size;
+    header *h = reinterpret_cast<header *>(block);
+    if (h->pool) {
+      h->pool->deallocate(block, h->size);
+    } else {
+      ::operator delete(block);
+    }
+  }
+
+  static void *operator new(size_t n) { return allocate(nullptr, n); }
+  template <typename... A>
+  static void *operator new(size_t n, coro_webview &w, A &...);
+  template <typename C, typename... A>
+  static void *operator new(size_t n, C &, coro_webview &w, A &...);
+
+  static void operator delete(void *p) { release(p); }
+  // Match the placement forms above, used if a frame fails to construct.
+  template <typename... A>
+  static void operator delete(void *p, coro_webview &, A &...) {
+    release(p);
+  }
+  template <typename C, typename... A>
+  static void operator delete(void *p, C &, coro_webview &, A &...) {
+    release(p);
+  }
+};
+
+template <typename T> struct task_promise_base : frame_alloc {
+  struct final_awaiter {
+    bool await_ready() noexcept { return false; }
+    template <typename P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+      return h.promise().continuation;
+    }
+    void await_resume() noexcept {}
+  };
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  final_awaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { error = std::current_exception(); }
+
+  std::coroutine_handle<> continuation = std::noop_coroutine();
+  std::exception_ptr error;
+};
+
+// Runs a task to completion without anyone waiting for it.
+struct detached {
+  struct promise_type : frame_alloc {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+} // namespace detail
+
+// A coroutine that starts when it is awaited and resumes its awaiter when it
+// finishes. Exceptions propagate to the awaiter.
+template <typename T = void> class task {
+public:
+  struct promise_type : detail::task_promise_base<T> {
+    task get_return_object() {
+      return task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    void return_value(T v) { value = std::move(v); }
+    std::optional<T> value;
+  };
+
+  task(task &&other) noexcept : m_h(std::exchange(other.m_h, {})) {}
+  task(const task &) = delete;
+  ~task() {
+    if (m_h) {
+      m_h.destroy();
+    }
+  }
+
+  bool await_ready() { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+    m_h.promise().continuation = awaiter;
+    return m_h;
+  }
+  T await_resume() {
+    if (m_h.promise().error) {
+      std::rethrow_exception(m_h.promise().error);
+    }
+    return std::move(*m_h.promise().value);
+  }
+
+private:
+  explicit task(std::coroutine_handle<promise_type> h) : m_h(h) {}
+  std::coroutine_handle<promise_type> m_h;
+};
+
+template <> class task<void> {
+public:
+  struct promise_type : detail::task_promise_base<void> {
+    task get_return_object() {
+      return task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    void return_void() {}
+  };
+
+  task(task &&other) noexcept : m_h(std::exchange(other.m_h, {})) {}
+  task(const task &) = delete;
+  ~task() {
+    if (m_h) {
+      m_h.destroy();
+    }
+  }
+
+  bool await_ready() { return false; }
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+    m_h.promise().continuation = awaiter;
+    return m_h;
+  }
+  void await_resume() {
+    if (m_h.promise().error) {
+      std::rethrow_exception(m_h.promise().error);
+    }
+  }
+
+private:
+  explicit task(std::coroutine_handle<promise_type> h) : m_h(h) {}
+  std::coroutine_handle<promise_type> m_h;
+};
+
+// A webview whose asynchronous operations can be awaited. Coroutines are
+// resumed on the main thread, except after on_main() when it was already
+// running there. All coroutines must finish before the webview is destroyed.
+class coro_webview : public webview {
+public:
+  coro_webview(int width, int height, bool hide = false, bool debug = false)
+      : webview(width, height, hide, debug) {
+    bind(call_binding, call_result{this}, nullptr);
+  }
+
+  using webview::eval_async;
+
+  struct main_awaiter {
+    coro_webview *w;
+    bool await_ready() { return w->is_main_thread(); }
+    void await_suspend(std::coroutine_handle<> h) {
+      w->dispatch([h]() { h.resume(); });
+    }
+    void await_resume() {}
+  };
+
+  // Continues the awaiting coroutine on the main thread.
+  main_awaiter on_main() { return {this}; }
+
+  struct eval_awaiter {
+    coro_webview *w;
+    std::string js;
+    std::string result;
+    std::string error;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+      w->eval_async(js, [this, h](std::string r, std::string e) {
+        result = std::move(r);
+        error = std::move(e);
+        h.resume();
+      });
+    }
+    std::string await_resume() {
+      if (!error.empty()) {
+        throw std::runtime_error(error);
+      }
+      return std::move(result);
+    }
+  };
+
+  // Evaluates js and resumes with its value as JSON, see eval_async(js, fn).
+  eval_awaiter eval_async(const std::string &js) {
+    return {this, js, {}, {}};
+  }
+
+  struct call_awaiter {
+    coro_webview *w;
+    std::string fn;
+    std::string args;
+    std::string result;
+    std::string error;
+    std::coroutine_handle<> h;
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> awaiter) {
+      h = awaiter;
+      w->dispatch([this]() { w->start_call(this); });
+    }
+    std::string await_resume() {
+      if (!error.empty()) {
+        throw std::runtime_error(error);
+      }
+      return std::move(result);
+    }
+  };
+
+  // Calls the page function window[fn] with args, a JSON array, and resumes
+  // with its result as JSON once the returned value or promise settles.
+  call_awaiter call_js(const std::string &fn, const std::string &args) {
+    return {this, fn, args, {}, {}, {}};
+  }
+
+  using coro_binding_t = std::function<task<std::string>(coro_webview &,
+                                                         std::string req)>;
+
+  // Binds a coroutine: the JavaScript promise resolves with its result, a
+  // JSON value, or rejects with the message of the exception it threw.
+  void bind_coro(const std::string &name, coro_binding_t fn) {
+    bind(name, coro_binding{this, std::move(fn)}, nullptr);
+  }
+
+private:
+  friend struct detail::frame_alloc;
+
+  static constexpr const char *call_binding = "_webview_call";
+
+  struct coro_binding {
+    coro_webview *w;
+    coro_binding_t fn;
+    void operator()(std::string seq, std::string req, void *) {
+      settle(w, fn(*w, std::move(req)), std::move(seq));
+    }
+  };
+
+  static detail::detached settle(coro_webview *w, task<std::string> t,
+                                 std::string seq) {
+    std::string error;
+    try {
+      w->resolve(seq, 0, co_await t);
+      co_return;
+    } catch (std::exception &e) {
+      error = e.what();
+    }
+    w->resolve(seq, 1, json_escape(error));
+  }
+
+  // Calls are identified by random tokens, so that the page can not settle
+  // a call it did not receive.
+  void start_call(call_awaiter *call) {
+    auto id = random_token();
+    m_calls[id] = call;
+    auto send = "window.external.invoke(JSON.stringify({id: '" + id +
+                "', method: '" + call_binding + "', params: ";
+    std::string js = "Promise.resolve().then(function() {";
+    js += "return window[" + json_escape(call->fn) + "].apply(null, " +
+          call->args + ");";
+    js += "}).then(function(r) {";
+    js += send + "[0, JSON.stringify(r === undefined ? null : r)]}));";
+    js += "}, function(e) {";
+    js += send + "[1, String(e)]}));";
+    js += "});";
+    eval(js);
+  }
+
+  // Receives the outcome of call_js() as [status, JSON or message].
+  struct call_result {
+    coro_webview *w;
+    void operator()(std::string seq, std::string req, void *) {
+      auto it = w->m_calls.find(seq);
+      if (it == w->m_calls.end()) {
+        return;
+      }
+      call_awaiter *call = it->second;
+      w->m_calls.erase(it);
+      if (json_parse(req, "", 0) == "0") {
+        call->result = json_parse(req, "", 1);
+      } else {
+        call->error = json_parse(req, "", 1);
+      }
+      call->h.resume();
+    }
+  };
+
+  // Calls into the previous page will never settle, they fail instead.
+  void on_page_committed() override {
+    std::map<std::string, call_awaiter *> calls;
+    calls.swap(m_calls);
+    for (auto &it : calls) {
+      it.second->error = "The page was unloaded";
+      it.second->h.resume();
+    }
+    webview::on_page_committed();
+  }
+
+  slab_pool m_frames;
+  std::map<std::string, call_awaiter *> m_calls; // By random id
+};
+
+template <typename... A>
+void *detail::frame_alloc::operator new(size_t n, coro_webview &w, A &...) {
+  return allocate(&w.m_frames, n);
+}
+
+template <typename C, typename... A>
+void *detail::frame_alloc::operator new(size_t n, C &, coro_webview &w,
+                                        A &...) {
+  return allocate(&w.m_frames, n);
+}
+
+} // namespace webview
+
+#endif /* WEBVIEW_CORO_H */
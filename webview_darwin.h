@@ -10,6 +10,7 @@
 
 #include <CoreGraphics/CoreGraphics.h>
 #include <objc/objc-runtime.h>
+#include <pthread.h>
 #include <iostream>
 
 namespace webview {
@@ -44,6 +45,7 @@ public:
   }
   ~cocoa_wkwebview_engine() { close(); }
   void *window() { return (void *)m_app; }
+  bool is_main_thread() const { return pthread_main_np() != 0; }
 
   void show() {
       ((void (*)(id, SEL))objc_msgSend)(m_app, METHOD("show"));
@@ -59,38 +61,91 @@ public:
   void run() {
     ((void (*)(id, SEL))objc_msgSend)(m_app, METHOD("run"));
   }
-  void dispatch(std::function<void()> f) {
-    dispatch_async_f(dispatch_get_main_queue(), new dispatch_fn_t(f),
+
+  // NSApplication has to own the main thread, external event loops are not
+  // supported on this backend.
+  int loop_fd() { return -1; }
+  bool loop_iterate(bool) { return false; }
+  // The main queue is serial, priorities only affect the GTK backend.
+  void dispatch(dispatch_priority, dispatch_fn_t f) { dispatch(std::move(f)); }
+  void dispatch(dispatch_fn_t f) {
+    struct main_task {
+      cocoa_wkwebview_engine *w;
+      dispatch_fn_t f;
+    };
+    auto t = new main_task{this, std::move(f)};
+    dispatch_async_f(dispatch_get_main_queue(), t,
                      (dispatch_function_t)([](void *arg) {
-                       auto f = static_cast<dispatch_fn_t *>(arg);
-                       (*f)();
-                       delete f;
+                       auto t = static_cast<main_task *>(arg);
+                       {
+                         task_monitor::scope task(t->w->m_monitor, "dispatch");
+                         load_meter::scope load(t->w->m_load,
+                                                main_activity::dispatch);
+                         t->f();
+                       }
+                       delete t;
                      }));
   }
 
   void set_icon(const std::string icon) {
   }
 
-  void set_title(const std::string title) {
+  // Dispatched closures are not budgeted on this backend.
+  void set_dispatch_budget(int, int = 16667) {}
+  webview_stats_t stats() { return webview_stats_t{}; }
+
+  // Main loop timers are not available on this backend.
+  template <typename F> webview_timer_t dispatch_after(int, F &&) { return 0; }
+  template <typename F> webview_timer_t every(int, F &&) { return 0; }
+  bool cancel_timer(webview_timer_t) { return false; }
+  void set_timer_tolerance(int) {}
+
+  void set_title(const std::string &title) {
     ((void (*)(id, SEL, id))objc_msgSend)(m_app, METHOD("setTitle:"),NSTR(title.c_str()));
   }
   void set_size(int width, int height, int hints) {
       ((void (*)(id, SEL, int,int,int))objc_msgSend)(m_app, METHOD("setSize:height:hints:"),width,height,hints);
 
   }
-  void navigate(const std::string url) {
+  void navigate(const std::string &url) {
     ((void (*)(id, SEL, id))objc_msgSend)(m_app, METHOD("navigate:"),NSTR(url.c_str()));
   }
-  void init(const std::string js) {
-      ((void (*)(id, SEL, id))objc_msgSend)(m_app, METHOD("initJS:"),NSTR(js.c_str()));
-
+  // Returns an id for uninit().
+  int init(const std::string &js, inject_at at = inject_at::document_start) {
+      ((void (*)(id, SEL, id, BOOL))objc_msgSend)(m_app, METHOD("initJS:atEnd:"),NSTR(js.c_str()),at == inject_at::document_end);
+      m_scripts[++m_last_script] = js;
+      return m_last_script;
+  }
+  // Removes a script added by init() from pages loaded from now on.
+  void uninit(int id) {
+    auto it = m_scripts.find(id);
+    if (it == m_scripts.end()) {
+      return;
+    }
+    ((void (*)(id, SEL, id))objc_msgSend)(m_app, METHOD("removeJS:"),NSTR(it->second.c_str()));
+    m_scripts.erase(it);
   }
-  void eval(const std::string js) {
+  void eval(const std::string &js) {
       ((void (*)(id, SEL, id))objc_msgSend)(m_app, METHOD("evalJS:"),NSTR(js.c_str()));
   }
+  void eval_async(const std::string &js, eval_callback_t fn) {
+      ((void (*)(id, SEL, id, void (*)(const char *, const char *, void *), void *))objc_msgSend)(m_app, METHOD("evalJS:completion:arg:"),NSTR(js.c_str()),eval_finished,new eval_callback_t(std::move(fn)));
+  }
+  static void eval_finished(const char *result, const char *error, void *arg) {
+    std::unique_ptr<eval_callback_t> fn(static_cast<eval_callback_t *>(arg));
+    (*fn)(result ? result : "", error ? error : "");
+  }
 
 private:
   virtual void on_message(const std::string msg) = 0;
+
+protected:
+  task_monitor m_monitor;
+  load_meter m_load;
+
+private:
+  std::map<int, std::string> m_scripts;
+  int m_last_script = 0;
   void close() { ((void (*)(id, SEL))objc_msgSend)(m_app, METHOD("close")); }
   id m_app;
 
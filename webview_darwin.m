@@ -59,7 +59,10 @@
 -(void)setTitle:(NSString*)title;
 -(void) setSize:(NSInteger)width height:(NSInteger)height hints:(NSInteger)hints;
 -(void) initJS:(NSString*)js;
+-(void) initJS:(NSString*)js atEnd:(BOOL)atEnd;
+-(void) removeJS:(NSString*)js;
 -(void) evalJS:(NSString*)js;
+-(void) evalJS:(NSString*)js completion:(void (*)(const char *result, const char *error, void *arg))fn arg:(void *)arg;
 -(void) navigate:(NSString *)url;
 -(BOOL) applicationShouldTerminateAfterLastWindowClosed:(NSApplication *)sender;
 -(void)userContentController:(WKUserContentController *)userContentController didReceiveScriptMessage:(WKScriptMessage *)message;
@@ -111,18 +114,58 @@
 
 
 -(void) initJS:(NSString *)js {
+    [self initJS:js atEnd:NO];
+}
+
+-(void) initJS:(NSString *)js atEnd:(BOOL)atEnd {
+    WKUserScriptInjectionTime time = atEnd ? WKUserScriptInjectionTimeAtDocumentEnd : WKUserScriptInjectionTimeAtDocumentStart;
     dispatch_async(dispatch_get_main_queue(),^{
-    [self->_manager addUserScript:[[WKUserScript alloc] initWithSource:js injectionTime:WKUserScriptInjectionTimeAtDocumentStart forMainFrameOnly:YES]];
+    [self->_manager addUserScript:[[WKUserScript alloc] initWithSource:js injectionTime:time forMainFrameOnly:YES]];
     });
 
 }
 
+-(void) removeJS:(NSString *)js {
+    dispatch_async(dispatch_get_main_queue(),^{
+    NSArray<WKUserScript *> *scripts = [self->_manager.userScripts copy];
+    BOOL removed = NO;
+    [self->_manager removeAllUserScripts];
+    for (WKUserScript *script in scripts) {
+        if (!removed && [script.source isEqualToString:js]) {
+            removed = YES;
+            continue;
+        }
+        [self->_manager addUserScript:script];
+    }
+    });
+}
+
 -(void) evalJS:(NSString *)js{
     dispatch_async(dispatch_get_main_queue(),^{
         [self->_webview evaluateJavaScript:js completionHandler:nil];
     });
 }
 
+-(void) evalJS:(NSString *)js completion:(void (*)(const char *, const char *, void *))fn arg:(void *)arg {
+    dispatch_async(dispatch_get_main_queue(),^{
+        [self->_webview evaluateJavaScript:js completionHandler:^(id result, NSError *error) {
+            if (error != nil) {
+                NSString *message = error.userInfo[@"WKJavaScriptExceptionMessage"];
+                fn(NULL, [(message != nil ? message : error.localizedDescription) UTF8String], arg);
+                return;
+            }
+            NSString *json = @"null";
+            if (result != nil) {
+                NSData *data = [NSJSONSerialization dataWithJSONObject:result options:NSJSONWritingFragmentsAllowed error:nil];
+                if (data != nil) {
+                    json = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
+                }
+            }
+            fn([json UTF8String], NULL, arg);
+        }];
+    });
+}
+
 -(void) setDelegate:(id<MessageDelegate>)delegate{
     _delegate = delegate;
 }
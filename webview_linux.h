@@ -12,6 +12,26 @@
 #include <gtk/gtk.h>
 #include <webkit2/webkit2.h>
 
+#include <algorithm>
+#include <queue>
+#include <unordered_map>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// webkit_web_view_call_async_javascript_function() is available.
+#if WEBKIT_CHECK_VERSION(2, 40, 0)
+#define WEBVIEW_CALL_RESOLVER
+#endif
+
+// Custom URI scheme requests expose their HTTP headers, e.g. Origin, and
+// responses can carry them, e.g. Access-Control-Allow-Origin.
+#if WEBKIT_CHECK_VERSION(2, 36, 0)
+#define WEBVIEW_RESULT_SCHEME
+#endif
+
 namespace webview {
 
 class gtk_webkit_engine {
@@ -75,6 +95,72 @@ public:
     }
     gtk_window_set_position( GTK_WINDOW(m_window), GTK_WIN_POS_CENTER_ALWAYS );
     gtk_widget_show_all(m_window);
+
+    // Events are charged from the moment one of the widgets starts handling
+    // them until the outermost handling is done. Keyboard events reach the
+    // web view from within the window's handler.
+    for (GtkWidget *widget : {m_window, m_webview}) {
+      g_signal_connect(widget, "event", G_CALLBACK(event_started), this);
+      g_signal_connect(widget, "event-after", G_CALLBACK(event_finished),
+                       this);
+    }
+    engines().push_back(this);
+
+#if WEBKIT_CHECK_VERSION(2, 34, 0)
+    g_signal_connect(m_webview, "notify::is-web-process-responsive",
+                     G_CALLBACK(+[](WebKitWebView *view, GParamSpec *,
+                                    gpointer arg) {
+                       static_cast<gtk_webkit_engine *>(arg)
+                           ->m_monitor.page_responsive(
+                               webkit_web_view_get_is_web_process_responsive(
+                                   view));
+                     }),
+                     this);
+#endif
+
+#if defined(WEBVIEW_RESULT_SCHEME)
+    register_result_scheme();
+#endif
+    g_signal_connect(m_webview, "load-changed", G_CALLBACK(load_changed),
+                     this);
+
+    // Dispatched closures go through one queue per priority lane. Each lane
+    // is drained in batches by its own GSource, woken up via eventfd.
+    // Input-critical closures are never deferred by the frame budget.
+    attach_lane(dispatch_priority::input, G_PRIORITY_DEFAULT, 128, false);
+    attach_lane(dispatch_priority::normal, G_PRIORITY_HIGH_IDLE, 128, true);
+    attach_lane(dispatch_priority::background, G_PRIORITY_DEFAULT_IDLE, 1,
+                true);
+
+    // All timers share one source whose ready time tracks the earliest
+    // deadline.
+    m_timer_source = g_source_new(timer_source_funcs(), sizeof(timer_source));
+    reinterpret_cast<timer_source *>(m_timer_source)->engine = this;
+    g_source_set_priority(m_timer_source, G_PRIORITY_DEFAULT);
+    g_source_set_name(m_timer_source, "webview timers");
+    g_source_attach(m_timer_source, nullptr);
+  }
+
+  virtual ~gtk_webkit_engine() {
+    auto &all = engines();
+    all.erase(std::find(all.begin(), all.end(), this));
+    if (m_loop_fd >= 0) {
+      close(m_loop_fd);
+      close(m_loop_timer_fd);
+    }
+    if (m_loop_acquired) {
+      g_main_context_release(g_main_context_default());
+    }
+    for (auto &s : m_scripts) {
+      webkit_user_script_unref(s.second);
+    }
+    g_source_destroy(m_timer_source);
+    g_source_unref(m_timer_source);
+    for (auto &lane : m_lanes) {
+      g_source_destroy(lane.source);
+      g_source_unref(lane.source);
+      close(lane.fd);
+    }
   }
 
   GdkPixbuf * create_pixbuf(const gchar *filename)
@@ -109,8 +195,58 @@ public:
 
 
   void *window() { return (void *)m_window; }
+  bool is_main_thread() const {
+    return std::this_thread::get_id() == m_main_thread;
+  }
   void run() { gtk_main(); }
-  void terminate() { gtk_main_quit(); }
+  void terminate() {
+    m_loop_quit = true;
+    if (gtk_main_level() > 0) {
+      gtk_main_quit();
+    }
+  }
+
+  // Returns an epoll fd that becomes readable whenever the main loop has work
+  // to do. It mirrors the fds of the GLib main context and a timerfd for its
+  // next timeout, and is kept up to date by loop_iterate(). Must be called
+  // from the main thread.
+  int loop_fd() {
+    if (m_loop_fd < 0) {
+      m_loop_fd = epoll_create1(EPOLL_CLOEXEC);
+      m_loop_timer_fd =
+          timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+      epoll_event ev = {};
+      ev.events = EPOLLIN;
+      ev.data.fd = m_loop_timer_fd;
+      epoll_ctl(m_loop_fd, EPOLL_CTL_ADD, m_loop_timer_fd, &ev);
+      if (m_loop_prepared) {
+        sync_loop_fd();
+      } else {
+        loop_prepare();
+      }
+    }
+    return m_loop_fd;
+  }
+
+  // Runs one main loop iteration instead of handing the thread over to
+  // run(). If blocking is true and nothing is ready, waits for the next
+  // event or timeout. Returns false once terminate() was called.
+  bool loop_iterate(bool blocking) {
+    GMainContext *ctx = g_main_context_default();
+    if (!m_loop_prepared) {
+      loop_prepare();
+    }
+    g_poll(m_loop_poll_fds.data(), m_loop_poll_fds.size(),
+           blocking ? m_loop_timeout : 0);
+    if (g_main_context_check(ctx, m_loop_priority, m_loop_poll_fds.data(),
+                             m_loop_poll_fds.size())) {
+      g_main_context_dispatch(ctx);
+    }
+    // Prepare the next iteration right away, so that loop_fd() reflects the
+    // sources and the timeout the main loop is going to wait for.
+    loop_prepare();
+    return !m_loop_quit;
+  }
 
   void hide(){
       g_idle_add(GSourceFunc(hideWindowMain),this);
@@ -141,16 +277,83 @@ public:
   }
 
 
-  void dispatch(std::function<void()> f) {
-    g_idle_add_full(G_PRIORITY_HIGH_IDLE, (GSourceFunc)([](void *f) -> int {
-                      (*static_cast<dispatch_fn_t *>(f))();
-                      return G_SOURCE_REMOVE;
-                    }),
-                    new std::function<void()>(f),
-                    [](void *f) { delete static_cast<dispatch_fn_t *>(f); });
+  // Safe to call from any thread. Closures too big to be stored inline are
+  // boxed in the engine's slab pool, so the common path does not allocate.
+  template <typename F> void dispatch(F &&f) {
+    dispatch(dispatch_priority::normal,
+             dispatch_fn_t(std::forward<F>(f), &m_pool));
   }
 
-  void set_title(const std::string title) {
+  template <typename F> void dispatch(dispatch_priority priority, F &&f) {
+    dispatch(priority, dispatch_fn_t(std::forward<F>(f), &m_pool));
+  }
+
+  void dispatch(dispatch_fn_t f) {
+    dispatch(dispatch_priority::normal, std::move(f));
+  }
+
+  // Only the call that makes a lane non-empty (as seen by the main loop)
+  // pays for an eventfd write.
+  void dispatch(dispatch_priority priority, dispatch_fn_t f) {
+    auto &lane = m_lanes[static_cast<int>(priority)];
+    lane.pending.fetch_add(1, std::memory_order_relaxed);
+    lane.queue.push(std::move(f));
+    if (!lane.signaled.exchange(true, std::memory_order_acq_rel)) {
+      uint64_t one = 1;
+      ssize_t n = write(lane.fd, &one, sizeof(one));
+      (void)n;
+    }
+  }
+
+  // Limits how much main thread time dispatched closures may take per frame.
+  // Once budget_us is used up, normal and background closures wait for the
+  // next frame so that redraws and WebKit IPC get to run. A budget of zero
+  // disables the limit. Must be called from the UI thread.
+  void set_dispatch_budget(int budget_us, int frame_us = 16667) {
+    m_budget_us = budget_us > 0 ? budget_us : 0;
+    m_frame_us = frame_us > 0 ? frame_us : 16667;
+    m_resume_at = 0;
+  }
+
+  // Runs f on the main thread once, ms milliseconds from now. Safe to call
+  // from any thread.
+  template <typename F> webview_timer_t dispatch_after(int ms, F &&f) {
+    return add_timer(ms, 0, dispatch_fn_t(std::forward<F>(f), &m_pool));
+  }
+
+  // Runs f on the main thread every ms milliseconds until cancelled. Missed
+  // periods are skipped rather than run back to back. Safe to call from any
+  // thread.
+  template <typename F> webview_timer_t every(int ms, F &&f) {
+    return add_timer(ms, ms > 0 ? ms : 1,
+                     dispatch_fn_t(std::forward<F>(f), &m_pool));
+  }
+
+  // Returns false if the timer has already fired or was cancelled.
+  bool cancel_timer(webview_timer_t id) {
+    std::lock_guard<std::mutex> lock(m_timer_mutex);
+    bool found = m_timers.erase(id) > 0;
+    update_timer_source();
+    return found;
+  }
+
+  // Timers may fire up to ms milliseconds late, so that timers whose
+  // deadlines fall within that window share a single wakeup.
+  void set_timer_tolerance(int ms) {
+    std::lock_guard<std::mutex> lock(m_timer_mutex);
+    m_timer_tolerance = ms > 0 ? gint64(ms) * 1000 : 0;
+    update_timer_source();
+  }
+
+  webview_stats_t stats() {
+    webview_stats_t s = {};
+    s.executed = m_executed.load(std::memory_order_relaxed);
+    s.deferred = m_deferred.load(std::memory_order_relaxed);
+    s.budget_overruns = m_budget_overruns.load(std::memory_order_relaxed);
+    return s;
+  }
+
+  void set_title(const std::string &title) {
     gtk_window_set_title(GTK_WINDOW(m_window), title.c_str());
   }
 
@@ -171,30 +374,624 @@ public:
     }
   }
 
-  void navigate(const std::string url) {
+  void navigate(const std::string &url) {
     webkit_web_view_load_uri(WEBKIT_WEB_VIEW(m_webview), url.c_str());
   }
 
-  void init(const std::string js) {
+  // Returns an id for uninit().
+  int init(const std::string &js, inject_at at = inject_at::document_start) {
     WebKitUserContentManager *manager =
         webkit_web_view_get_user_content_manager(WEBKIT_WEB_VIEW(m_webview));
-    webkit_user_content_manager_add_script(
-        manager, webkit_user_script_new(
-                     js.c_str(), WEBKIT_USER_CONTENT_INJECT_TOP_FRAME,
-                     WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_START, NULL, NULL));
+    WebKitUserScript *script = webkit_user_script_new(
+        js.c_str(), WEBKIT_USER_CONTENT_INJECT_TOP_FRAME,
+        at == inject_at::document_end
+            ? WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_END
+            : WEBKIT_USER_SCRIPT_INJECT_AT_DOCUMENT_START,
+        NULL, NULL);
+    webkit_user_content_manager_add_script(manager, script);
+    m_scripts.emplace_back(++m_last_script, script);
+    return m_last_script;
   }
 
-  void eval(const std::string js) {
+  // Removes a script added by init() from pages loaded from now on.
+  void uninit(int id) {
+    auto it = std::find_if(
+        m_scripts.begin(), m_scripts.end(),
+        [=](const std::pair<int, WebKitUserScript *> &s) {
+          return s.first == id;
+        });
+    if (it == m_scripts.end()) {
+      return;
+    }
+    WebKitUserScript *script = it->second;
+    m_scripts.erase(it);
+    WebKitUserContentManager *manager =
+        webkit_web_view_get_user_content_manager(WEBKIT_WEB_VIEW(m_webview));
+#if WEBKIT_CHECK_VERSION(2, 32, 0)
+    webkit_user_content_manager_remove_script(manager, script);
+#else
+    webkit_user_content_manager_remove_all_scripts(manager);
+    for (auto &s : m_scripts) {
+      webkit_user_content_manager_add_script(manager, s.second);
+    }
+#endif
+    webkit_user_script_unref(script);
+  }
+
+  void eval(const std::string &js) {
     webkit_web_view_run_javascript(WEBKIT_WEB_VIEW(m_webview), js.c_str(), NULL,
                                    NULL, NULL);
   }
+
+  void eval_async(const std::string &js, eval_callback_t fn) {
+    webkit_web_view_run_javascript(WEBKIT_WEB_VIEW(m_webview), js.c_str(), NULL,
+                                   eval_finished,
+                                   new eval_callback_t(std::move(fn)));
+  }
+
+#if defined(WEBVIEW_RESULT_SCHEME)
+  // Keeps a binding result until the page fetches it from
+  // webview-rpc://result/<token>, so that it never becomes script source or
+  // a JavaScript string. Only the stub waiting for the result gets the
+  // random token.
+  std::string park_result(const std::string &seq, int status,
+                          std::string result) {
+    auto token = random_token();
+    m_parked[token] = parked_result{seq, status, std::move(result)};
+    return token;
+  }
+
+  // Settles a parked result inline, for pages that can't load the scheme.
+  void unpark_result(const std::string &token) {
+    auto it = m_parked.find(token);
+    if (it == m_parked.end()) {
+      return;
+    }
+    parked_result parked = std::move(it->second);
+    m_parked.erase(it);
+#if defined(WEBVIEW_CALL_RESOLVER)
+    call_resolver(parked.seq, parked.status, std::move(parked.result));
+#else
+    // The result is JSON, hence a valid JavaScript expression.
+    auto &seq = parked.seq;
+    eval("window._rpc[" + seq + "]." +
+         (parked.status == 0 ? "resolve(" : "reject(") + parked.result +
+         "); window._rpc[" + seq + "] = undefined");
+#endif
+  }
+#endif
+
+#if defined(WEBVIEW_CALL_RESOLVER)
+  // Settles a binding call by passing the result to window._rpc.settle() as
+  // a string argument: the result is parsed with JSON.parse() rather than as
+  // script source, and handed to WebKit without another copy.
+  void call_resolver(const std::string &seq, int status, std::string result) {
+    // GVariant strings are trusted to be NUL-free UTF-8.
+    if (!g_utf8_validate(result.data(), result.size(), NULL)) {
+      status = 1;
+      result = "\"Binding result is not valid UTF-8\"";
+    }
+    auto owned = new std::string(std::move(result));
+    GBytes *bytes = g_bytes_new_with_free_func(
+        owned->c_str(), owned->size() + 1,
+        [](gpointer s) { delete static_cast<std::string *>(s); }, owned);
+    GVariantDict args;
+    g_variant_dict_init(&args, NULL);
+    g_variant_dict_insert_value(&args, "seq",
+                                g_variant_new_string(seq.c_str()));
+    g_variant_dict_insert_value(&args, "status", g_variant_new_int32(status));
+    g_variant_dict_insert_value(
+        &args, "result",
+        g_variant_new_from_bytes(G_VARIANT_TYPE_STRING, bytes, TRUE));
+    g_bytes_unref(bytes);
+    static const char body[] = "window._rpc.settle(seq, status, result)";
+    webkit_web_view_call_async_javascript_function(
+        WEBKIT_WEB_VIEW(m_webview), body, -1, g_variant_dict_end(&args), NULL,
+        NULL, NULL, NULL, NULL);
+  }
+#endif
 private:
+  struct dispatch_lane {
+    dispatch_lane(slab_pool *pool) : queue(pool) {}
+    gtk_webkit_engine *engine = nullptr;
+    int fd = -1;
+    GSource *source = nullptr;
+    gpointer tag = nullptr;
+    // Maximum number of closures run per source callback, so that a flood
+    // of dispatches can not starve other sources of the same priority.
+    int batch_size = 0;
+    bool budgeted = false;
+    mpsc_queue<dispatch_fn_t> queue;
+    std::atomic<bool> signaled{false};
+    std::atomic<uint64_t> pending{0};
+    // Oldest closures of the queue already counted as deferred, only touched
+    // on the main thread.
+    uint64_t deferred = 0;
+  };
+
+  struct dispatch_source {
+    GSource source;
+    dispatch_lane *lane;
+  };
+
+  void attach_lane(dispatch_priority priority, gint source_priority,
+                   int batch_size, bool budgeted) {
+    auto &lane = m_lanes[static_cast<int>(priority)];
+    lane.engine = this;
+    lane.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    lane.batch_size = batch_size;
+    lane.budgeted = budgeted;
+    lane.source =
+        g_source_new(dispatch_source_funcs(), sizeof(dispatch_source));
+    reinterpret_cast<dispatch_source *>(lane.source)->lane = &lane;
+    g_source_set_priority(lane.source, source_priority);
+    g_source_set_name(lane.source, "webview dispatch");
+    lane.tag = g_source_add_unix_fd(lane.source, lane.fd, G_IO_IN);
+    g_source_attach(lane.source, nullptr);
+  }
+
+  // A budgeted lane that used up the frame budget sleeps until the next
+  // frame starts, no matter how many closures are queued.
+  bool yielded(dispatch_lane *lane, gint64 now) {
+    return lane->budgeted && m_budget_us > 0 && now < m_resume_at;
+  }
+
+  static void drain_eventfd(dispatch_lane *lane) {
+    uint64_t n;
+    while (read(lane->fd, &n, sizeof(n)) > 0) {
+    }
+  }
+
+  static gboolean dispatch_prepare(GSource *source, gint *timeout) {
+    auto lane = reinterpret_cast<dispatch_source *>(source)->lane;
+    auto w = lane->engine;
+    w->finish_events();
+    gint64 now = g_source_get_time(source);
+    if (w->yielded(lane, now)) {
+      *timeout = static_cast<gint>((w->m_resume_at - now + 999) / 1000);
+      return FALSE;
+    }
+    *timeout = -1;
+    return !lane->queue.empty();
+  }
+
+  static gboolean dispatch_check(GSource *source) {
+    auto lane = reinterpret_cast<dispatch_source *>(source)->lane;
+    if (lane->engine->yielded(lane, g_source_get_time(source))) {
+      // Swallow the wakeup, the lane stays signaled until it runs again.
+      drain_eventfd(lane);
+      return FALSE;
+    }
+    return (g_source_query_unix_fd(source, lane->tag) & G_IO_IN) ||
+           !lane->queue.empty();
+  }
+
+  static gboolean dispatch_run(GSource *source, GSourceFunc, gpointer) {
+    auto lane = reinterpret_cast<dispatch_source *>(source)->lane;
+    auto w = lane->engine;
+    load_meter::scope load(w->m_load, main_activity::dispatch);
+    // Re-arm before draining: anything pushed after this point either gets
+    // drained below or signals the eventfd again.
+    lane->signaled.exchange(false, std::memory_order_acq_rel);
+    drain_eventfd(lane);
+    bool budgeted = w->m_budget_us > 0;
+    gint64 now = budgeted ? g_get_monotonic_time() : 0;
+    if (budgeted && now >= w->m_frame_start + w->m_frame_us) {
+      w->m_frame_start = now;
+      w->m_frame_spent = 0;
+    }
+    dispatch_fn_t f;
+    for (int i = 0; i < lane->batch_size; i++) {
+      if (budgeted && lane->budgeted && w->m_frame_spent >= w->m_budget_us) {
+        w->m_resume_at = w->m_frame_start + w->m_frame_us;
+        // Closures still deferred from an earlier frame were counted then.
+        uint64_t pending = lane->pending.load(std::memory_order_relaxed);
+        if (pending > lane->deferred) {
+          w->m_deferred.fetch_add(pending - lane->deferred,
+                                  std::memory_order_relaxed);
+          lane->deferred = pending;
+        }
+        break;
+      }
+      if (!lane->queue.pop(f)) {
+        break;
+      }
+      lane->pending.fetch_sub(1, std::memory_order_relaxed);
+      if (lane->deferred > 0) {
+        lane->deferred--;
+      }
+      {
+        task_monitor::scope task(w->m_monitor, "dispatch");
+        f();
+      }
+      f = nullptr;
+      w->m_executed.fetch_add(1, std::memory_order_relaxed);
+      if (budgeted) {
+        // A single closure that takes longer than the whole budget can not
+        // be sliced and is reported as an overrun.
+        gint64 end = g_get_monotonic_time();
+        if (end - now > w->m_budget_us) {
+          w->m_budget_overruns.fetch_add(1, std::memory_order_relaxed);
+        }
+        w->m_frame_spent += end - now;
+        now = end;
+      }
+    }
+    return G_SOURCE_CONTINUE;
+  }
+
+  struct timer {
+    gint64 deadline;
+    gint64 period; // Zero for one-shot timers
+    dispatch_fn_t fn;
+  };
+
+  struct timer_due {
+    gint64 deadline;
+    webview_timer_t id;
+    bool operator>(const timer_due &other) const {
+      return deadline != other.deadline ? deadline > other.deadline
+                                        : id > other.id;
+    }
+  };
+
+  struct timer_source {
+    GSource source;
+    gtk_webkit_engine *engine;
+  };
+
+  webview_timer_t add_timer(int ms, int period_ms, dispatch_fn_t f) {
+    gint64 deadline = g_get_monotonic_time() + gint64(ms > 0 ? ms : 0) * 1000;
+    std::lock_guard<std::mutex> lock(m_timer_mutex);
+    webview_timer_t id = m_next_timer++;
+    m_timers.emplace(id,
+                     timer{deadline, gint64(period_ms) * 1000, std::move(f)});
+    m_timer_heap.push(timer_due{deadline, id});
+    update_timer_source();
+    return id;
+  }
+
+  // Drops heap entries of cancelled or rescheduled timers and moves the ready
+  // time of the timer source to the earliest deadline plus the tolerance.
+  // Must be called with m_timer_mutex held.
+  void update_timer_source() {
+    while (!m_timer_heap.empty()) {
+      auto it = m_timers.find(m_timer_heap.top().id);
+      if (it != m_timers.end() &&
+          it->second.deadline == m_timer_heap.top().deadline) {
+        break;
+      }
+      m_timer_heap.pop();
+    }
+    gint64 ready = m_timer_heap.empty()
+                       ? -1
+                       : m_timer_heap.top().deadline + m_timer_tolerance;
+    if (ready != m_timer_ready) {
+      m_timer_ready = ready;
+      g_source_set_ready_time(m_timer_source, ready);
+    }
+  }
+
+  static gboolean timer_run(GSource *source, GSourceFunc, gpointer) {
+    auto w = reinterpret_cast<timer_source *>(source)->engine;
+    load_meter::scope load(w->m_load, main_activity::dispatch);
+    gint64 now = g_get_monotonic_time();
+    std::unique_lock<std::mutex> lock(w->m_timer_mutex);
+    while (!w->m_timer_heap.empty() && w->m_timer_heap.top().deadline <= now) {
+      timer_due due = w->m_timer_heap.top();
+      w->m_timer_heap.pop();
+      auto it = w->m_timers.find(due.id);
+      if (it == w->m_timers.end() || it->second.deadline != due.deadline) {
+        continue;
+      }
+      dispatch_fn_t f = std::move(it->second.fn);
+      gint64 period = it->second.period;
+      if (period == 0) {
+        w->m_timers.erase(it);
+      }
+      lock.unlock();
+      {
+        task_monitor::scope task(w->m_monitor, "timer");
+        f();
+      }
+      lock.lock();
+      // The timer may have been cancelled while it was running.
+      it = w->m_timers.find(due.id);
+      if (period > 0 && it != w->m_timers.end()) {
+        gint64 next = due.deadline + period;
+        if (next <= now) {
+          next = now + period - (now - due.deadline) % period;
+        }
+        it->second.deadline = next;
+        it->second.fn = std::move(f);
+        w->m_timer_heap.push(timer_due{next, due.id});
+      }
+    }
+    w->m_timer_ready = 0;
+    w->update_timer_source();
+    return G_SOURCE_CONTINUE;
+  }
+
+  static GSourceFuncs *timer_source_funcs() {
+    static GSourceFuncs funcs = {nullptr, nullptr, timer_run,
+                                 nullptr, nullptr, nullptr};
+    return &funcs;
+  }
+
+  void loop_prepare() {
+    GMainContext *ctx = g_main_context_default();
+    if (!m_loop_acquired) {
+      m_loop_acquired = g_main_context_acquire(ctx);
+    }
+    g_main_context_prepare(ctx, &m_loop_priority);
+    gint n;
+    while ((n = g_main_context_query(
+                ctx, m_loop_priority, &m_loop_timeout, m_loop_poll_fds.data(),
+                m_loop_poll_fds.size())) > (gint)m_loop_poll_fds.size()) {
+      m_loop_poll_fds.resize(n);
+    }
+    m_loop_poll_fds.resize(n);
+    m_loop_prepared = true;
+    if (m_loop_fd >= 0) {
+      sync_loop_fd();
+    }
+  }
+
+  // Brings the epoll set in line with the fds from the last query and arms
+  // the timerfd with its timeout.
+  void sync_loop_fd() {
+    std::map<int, uint32_t> fds;
+    for (auto &p : m_loop_poll_fds) {
+      uint32_t events = 0;
+      events |= (p.events & G_IO_IN) ? EPOLLIN : 0;
+      events |= (p.events & G_IO_OUT) ? EPOLLOUT : 0;
+      events |= (p.events & G_IO_PRI) ? EPOLLPRI : 0;
+      fds[p.fd] |= events;
+    }
+    for (auto &old : m_loop_epoll_fds) {
+      if (fds.find(old.first) == fds.end()) {
+        epoll_ctl(m_loop_fd, EPOLL_CTL_DEL, old.first, nullptr);
+      }
+    }
+    for (auto &fd : fds) {
+      auto old = m_loop_epoll_fds.find(fd.first);
+      if (old != m_loop_epoll_fds.end() && old->second == fd.second) {
+        continue;
+      }
+      epoll_event ev = {};
+      ev.events = fd.second;
+      ev.data.fd = fd.first;
+      epoll_ctl(m_loop_fd,
+                old == m_loop_epoll_fds.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                fd.first, &ev);
+    }
+    m_loop_epoll_fds.swap(fds);
+
+    // A zero timeout means a source is ready already, a negative one means
+    // no timeout; the smallest non-zero expiration fires right away.
+    itimerspec spec = {};
+    if (m_loop_timeout == 0) {
+      spec.it_value.tv_nsec = 1;
+    } else if (m_loop_timeout > 0) {
+      spec.it_value.tv_sec = m_loop_timeout / 1000;
+      spec.it_value.tv_nsec = (m_loop_timeout % 1000) * 1000000L;
+    }
+    timerfd_settime(m_loop_timer_fd, 0, &spec, nullptr);
+  }
+
+  static std::vector<gtk_webkit_engine *> &engines() {
+    static std::vector<gtk_webkit_engine *> all;
+    return all;
+  }
+
+  static gboolean event_started(GtkWidget *, GdkEvent *, gpointer arg) {
+    auto w = static_cast<gtk_webkit_engine *>(arg);
+    if (w->m_event_depth++ == 0) {
+      w->m_event_outer = w->m_load.begin(main_activity::events);
+    }
+    return FALSE;
+  }
+
+  static void event_finished(GtkWidget *, GdkEvent *, gpointer arg) {
+    auto w = static_cast<gtk_webkit_engine *>(arg);
+    if (w->m_event_depth > 0 && --w->m_event_depth == 0) {
+      w->m_load.end(w->m_event_outer);
+    }
+  }
+
+  static void load_changed(WebKitWebView *, WebKitLoadEvent event,
+                           gpointer arg) {
+    if (event != WEBKIT_LOAD_COMMITTED) {
+      return;
+    }
+    auto w = static_cast<gtk_webkit_engine *>(arg);
+#if defined(WEBVIEW_RESULT_SCHEME)
+    // Results parked for the previous page are dropped.
+    w->m_parked.clear();
+#endif
+    w->on_page_committed();
+  }
+
+  // Back in the main loop every event is handled, even those whose
+  // "event-after" never came, e.g. because their widget went away.
+  void finish_events() {
+    if (m_event_depth > 0) {
+      m_event_depth = 0;
+      m_load.end(m_event_outer);
+    }
+  }
+
+#if defined(WEBVIEW_RESULT_SCHEME)
+  // The scheme belongs to the shared web context, requests are routed to
+  // the engine owning the web view.
+  static void register_result_scheme() {
+    static bool registered = false;
+    if (registered) {
+      return;
+    }
+    registered = true;
+    WebKitWebContext *context = webkit_web_context_get_default();
+    webkit_web_context_register_uri_scheme(context, "webview-rpc",
+                                           serve_result, nullptr, nullptr);
+    WebKitSecurityManager *security =
+        webkit_web_context_get_security_manager(context);
+    webkit_security_manager_register_uri_scheme_as_secure(security,
+                                                           "webview-rpc");
+    webkit_security_manager_register_uri_scheme_as_cors_enabled(
+        security, "webview-rpc");
+  }
+
+  // The origin that a page loaded from uri sends with its requests, e.g.
+  // "https://example.com:8080", or "null" for data: and file: pages.
+  static std::string uri_origin(const char *uri) {
+    std::string s = uri ? uri : "";
+    auto scheme_end = s.find("://");
+    if (scheme_end == std::string::npos ||
+        s.compare(0, scheme_end, "file") == 0) {
+      return "null";
+    }
+    return s.substr(0, s.find_first_of("/?#", scheme_end + 3));
+  }
+
+  // Results are only served to the document of the web view that they were
+  // parked for. Returns its origin, or an empty string for other requests.
+  static std::string result_request_origin(WebKitURISchemeRequest *request,
+                                           WebKitWebView *view) {
+    SoupMessageHeaders *headers =
+        webkit_uri_scheme_request_get_http_headers(request);
+    const char *origin =
+        headers ? soup_message_headers_get_one(headers, "Origin") : nullptr;
+    auto page = uri_origin(webkit_web_view_get_uri(view));
+    return origin && page == origin ? page : std::string();
+  }
+
+  static void serve_result(WebKitURISchemeRequest *request, gpointer) {
+    WebKitWebView *view = webkit_uri_scheme_request_get_web_view(request);
+    std::string path = webkit_uri_scheme_request_get_path(request);
+    for (auto w : engines()) {
+      if (WEBKIT_WEB_VIEW(w->m_webview) != view) {
+        continue;
+      }
+      auto it = w->m_parked.find(path.substr(path.find('/') + 1));
+      auto origin = result_request_origin(request, view);
+      if (it == w->m_parked.end() || origin.empty()) {
+        break;
+      }
+      auto owned = new std::string(std::move(it->second.result));
+      w->m_parked.erase(it);
+      gint64 size = owned->size();
+      GBytes *bytes = g_bytes_new_with_free_func(
+          owned->data(), owned->size(),
+          [](gpointer s) { delete static_cast<std::string *>(s); }, owned);
+      GInputStream *stream = g_memory_input_stream_new_from_bytes(bytes);
+      g_bytes_unref(bytes);
+      WebKitURISchemeResponse *response =
+          webkit_uri_scheme_response_new(stream, size);
+      webkit_uri_scheme_response_set_content_type(response,
+                                                  "application/json");
+      // Only the page that the result was parked for may read it.
+      SoupMessageHeaders *headers =
+          soup_message_headers_new(SOUP_MESSAGE_HEADERS_RESPONSE);
+      soup_message_headers_append(headers, "Access-Control-Allow-Origin",
+                                  origin.c_str());
+      webkit_uri_scheme_response_set_http_headers(response, headers);
+      webkit_uri_scheme_request_finish_with_response(request, response);
+      g_object_unref(response);
+      g_object_unref(stream);
+      return;
+    }
+    GError *error = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                                        "No such result");
+    webkit_uri_scheme_request_finish_error(request, error);
+    g_error_free(error);
+  }
+#endif
+
+  static void eval_finished(GObject *view, GAsyncResult *res, gpointer arg) {
+    std::unique_ptr<eval_callback_t> fn(static_cast<eval_callback_t *>(arg));
+    GError *error = NULL;
+    WebKitJavascriptResult *r = webkit_web_view_run_javascript_finish(
+        WEBKIT_WEB_VIEW(view), res, &error);
+    if (r == NULL) {
+      std::string message = error->message;
+      g_error_free(error);
+      (*fn)("", message);
+      return;
+    }
+    std::string json = "null";
+#if WEBKIT_CHECK_VERSION(2, 28, 0)
+    char *s = jsc_value_to_json(webkit_javascript_result_get_js_value(r), 0);
+    if (s != NULL) {
+      json = s;
+      g_free(s);
+    }
+#endif
+    webkit_javascript_result_unref(r);
+    (*fn)(json, "");
+  }
+
+  static GSourceFuncs *dispatch_source_funcs() {
+    static GSourceFuncs funcs = {dispatch_prepare, dispatch_check,
+                                 dispatch_run, nullptr, nullptr, nullptr};
+    return &funcs;
+  }
+
   virtual void on_message(const std::string msg) = 0;
+  // Called once a new document replaces the previous one.
+  virtual void on_page_committed() {}
+
+protected:
+  task_monitor m_monitor;
+  load_meter m_load;
+
+private:
   GtkWidget *m_window;
   GtkWidget *m_webview;
+  std::vector<std::pair<int, WebKitUserScript *>> m_scripts;
+  struct parked_result {
+    std::string seq;
+    int status;
+    std::string result;
+  };
+  std::map<std::string, parked_result> m_parked; // By token
+  int m_event_depth = 0;
+  int m_event_outer = -1; // Activity the outermost event interrupted
+  int m_last_script = 0;
   bool m_hide;
+  std::thread::id m_main_thread = std::this_thread::get_id();
+  slab_pool m_pool;
+  dispatch_lane m_lanes[3]{{&m_pool}, {&m_pool}, {&m_pool}};
+  // Frame budget state, only touched on the main thread.
+  gint64 m_budget_us = 0;
+  gint64 m_frame_us = 16667;
+  gint64 m_frame_start = 0;
+  gint64 m_frame_spent = 0;
+  gint64 m_resume_at = 0;
+  std::atomic<uint64_t> m_executed{0};
+  std::atomic<uint64_t> m_deferred{0};
+  std::atomic<uint64_t> m_budget_overruns{0};
+  GSource *m_timer_source;
+  std::mutex m_timer_mutex;
+  std::unordered_map<webview_timer_t, timer> m_timers;
+  std::priority_queue<timer_due, std::vector<timer_due>,
+                      std::greater<timer_due>>
+      m_timer_heap;
+  webview_timer_t m_next_timer = 1;
+  gint64 m_timer_tolerance = 1000;
+  gint64 m_timer_ready = -1;
+  // State for driving the main loop from an external event loop.
+  std::atomic<bool> m_loop_quit{false};
+  bool m_loop_acquired = false;
+  bool m_loop_prepared = false;
+  gint m_loop_priority = 0;
+  gint m_loop_timeout = -1;
+  std::vector<GPollFD> m_loop_poll_fds;
+  int m_loop_fd = -1;
+  int m_loop_timer_fd = -1;
+  std::map<int, uint32_t> m_loop_epoll_fds;
 };
 
+
 using browser_engine = gtk_webkit_engine;
 
 } // namespace webview
@@ -1,22 +1,259 @@
-//bin/echo; [ $(uname) = "Darwin" ] && FLAGS="-framework Webkit" || FLAGS="$(pkg-config --cflags --libs gtk+-3.0 webkit2gtk-4.0)" ; c++ "$0" $FLAGS -std=c++11 -Wall -Wextra -pedantic -g -o webview_test && ./webview_test ; exit
+//bin/echo; [ $(uname) = "Darwin" ] && FLAGS="-framework Webkit" || FLAGS="$(pkg-config --cflags --libs gtk+-3.0 webkit2gtk-4.0)" ; c++ "$0" $FLAGS -std=c++11 -Wall -Wextra -pedantic -g -o webview_test && ./webview_test && c++ "$0" $FLAGS -std=c++20 -Wall -Wextra -pedantic -g -o webview_test20 && ./webview_test20 coro ; exit
 // +build ignore
 
 #include "webview.h"
+#if __cplusplus >= 202002L
+#include "webview_coro.h"
+#endif
 
 #include <cassert>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <thread>
 #include <unordered_map>
 
+#if defined(WEBVIEW_GTK)
+#include <poll.h>
+#endif
+
 // =================================================================
 // TEST: start app loop and terminate it.
 // =================================================================
 static void test_terminate() {
-  webview::webview w(false, nullptr);
+  webview::webview w(480, 320);
+  w.dispatch([&]() { w.terminate(); });
+  w.run();
+}
+
+// =================================================================
+// TEST: dispatch from many threads, every closure runs exactly once
+// and closures from the same thread run in order.
+// =================================================================
+static void test_dispatch_threads() {
+  const int threads = 8;
+  const int per_thread = 10000;
+  webview::webview w(480, 320);
+  std::vector<int> last(threads, -1);
+  int remaining = threads * per_thread;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      for (int i = 0; i < per_thread; i++) {
+        w.dispatch([&, t, i]() {
+          assert(last[t] == i - 1);
+          last[t] = i;
+          if (--remaining == 0) {
+            w.terminate();
+          }
+        });
+      }
+    });
+  }
+  w.run();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  assert(remaining == 0);
+}
+
+// =================================================================
+// TEST: dispatch_sync/dispatch_async return values from the main thread
+// and run inline when called on it.
+// =================================================================
+static void test_dispatch_sync() {
+  webview::webview w(480, 320);
+  assert(w.is_main_thread());
+  assert(w.dispatch_sync([]() { return 1; }) == 1);
+  auto ready = w.dispatch_async([]() { return 2; });
+  assert(ready.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+  std::thread worker([&]() {
+    assert(!w.is_main_thread());
+    int n = w.dispatch_sync([&]() {
+      assert(w.is_main_thread());
+      return 3;
+    });
+    assert(n == 3);
+    auto s = w.dispatch_async([]() { return std::string("4"); });
+    assert(s.get() == "4");
+    w.dispatch_sync([&]() { w.terminate(); });
+  });
+  w.run();
+  worker.join();
+}
+
+// =================================================================
+// TEST: the watchdog reports a dispatched function that blocks the
+// main thread, both while it runs and once it returns.
+// =================================================================
+static void test_watchdog() {
+  webview::webview w(480, 320);
+  std::mutex mutex;
+  std::vector<bool> reports;
+  w.set_watchdog(20, [&](int kind, const std::string &name, long long ms,
+                         bool finished) {
+    assert(kind == WEBVIEW_STALL_NATIVE);
+    assert(name == "dispatch");
+    assert(!finished || ms >= 20);
+    std::lock_guard<std::mutex> lock(mutex);
+    reports.push_back(finished);
+  });
+  w.dispatch([]() {});
+  w.dispatch([]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  });
+  w.dispatch([&]() { w.terminate(); });
+  w.run();
+  assert(reports.size() == 2);
+  assert(!reports[0] && reports[1]);
+  assert(w.stats().native_stalls == 1);
+}
+
+// =================================================================
+// TEST: main thread time spent in dispatched functions shows up in the
+// utilization of the window that dispatched them only.
+// =================================================================
+static void test_utilization() {
+  webview::webview w(480, 320);
+  webview::webview other(480, 320);
+  w.dispatch([]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  });
+  w.dispatch([&]() {
+    webview_utilization_t second, minute;
+    w.utilization(&second, &minute);
+    assert(second.dispatch >= 5 && second.dispatch <= 100);
+    assert(minute.dispatch >= second.dispatch * 0.5);
+    assert(second.bindings == 0 && second.eval == 0);
+    other.utilization(&second, &minute);
+    assert(second.dispatch < 5);
+    w.terminate();
+  });
+  w.run();
+}
+
+// =================================================================
+// TEST: keyed dispatches coalesce, higher priority lanes run first.
+// =================================================================
+static void test_dispatch_keyed() {
+  using webview::dispatch_priority;
+  webview::webview w(480, 320);
+  std::string order;
+  w.dispatch(dispatch_priority::background, [&]() { order += "b"; });
+  w.dispatch(dispatch_priority::normal, [&]() { order += "n"; });
+  // Out of range priorities fall back to the normal lane.
+  webview_dispatch_keyed(
+      &w, nullptr, 42,
+      [](webview_t, void *arg) { *static_cast<std::string *>(arg) += "x"; },
+      &order);
+  for (int i = 0; i <= 5; i++) {
+    w.dispatch("key", dispatch_priority::input,
+               [&, i]() { order += "i" + std::to_string(i); });
+  }
+  w.dispatch(dispatch_priority::background, [&]() { w.terminate(); });
+  w.run();
+#if defined(WEBVIEW_GTK)
+  assert(order == "i5nxb");
+#else
+  // Other backends run dispatched closures in order.
+  assert(order == "bnxi5");
+#endif
+}
+
+#if defined(WEBVIEW_GTK)
+// =================================================================
+// TEST: a dispatch budget spreads a backlog over several frames.
+// =================================================================
+static void test_dispatch_budget() {
+  webview::webview w(480, 320);
+  w.set_dispatch_budget(2000, 16667);
+  for (int i = 0; i < 20; i++) {
+    w.dispatch(
+        []() { std::this_thread::sleep_for(std::chrono::milliseconds(1)); });
+  }
+  w.dispatch(
+      []() { std::this_thread::sleep_for(std::chrono::milliseconds(5)); });
   w.dispatch([&]() { w.terminate(); });
   w.run();
+  auto stats = w.stats();
+  assert(stats.executed == 22);
+  // Each closure is counted once, however many frames it waited.
+  assert(stats.deferred > 0 && stats.deferred < 22);
+  assert(stats.budget_overruns == 1);
+}
+
+// =================================================================
+// TEST: one-shot and periodic timers fire in deadline order and stop
+// once cancelled.
+// =================================================================
+static void test_timers() {
+  webview::webview w(480, 320);
+  std::string order;
+  int ticks = 0;
+  webview_timer_t tick = 0;
+  tick = w.every(10, [&]() {
+    if (++ticks == 3) {
+      assert(w.cancel_timer(tick));
+    }
+  });
+  webview_timer_t never = w.dispatch_after(20, [&]() { order += "x"; });
+  w.dispatch_after(30, [&]() { order += "b"; });
+  w.dispatch_after(5, [&]() { order += "a"; });
+  assert(w.cancel_timer(never));
+  assert(!w.cancel_timer(never));
+  w.dispatch_after(100, [&]() {
+    assert(order == "ab");
+    assert(ticks == 3);
+    w.terminate();
+  });
+  w.run();
+}
+
+// =================================================================
+// TEST: drive the main loop from an external poll() loop.
+// =================================================================
+static void test_loop_fd() {
+  webview::webview w(480, 320);
+  int fd = w.loop_fd();
+  assert(fd >= 0);
+  int ran = 0;
+  std::thread worker([&]() {
+    w.dispatch([&]() {
+      ran++;
+      w.terminate();
+    });
+  });
+  bool running = true;
+  while (running) {
+    pollfd p = {fd, POLLIN, 0};
+    assert(poll(&p, 1, 1000) > 0);
+    running = w.loop_iterate(false);
+  }
+  worker.join();
+  assert(ran == 1);
+}
+
+// =================================================================
+// TEST: the page callback also runs for loads started by the page.
+// =================================================================
+static void test_page_callback() {
+  webview::webview w(480, 320);
+  int pages = 0;
+  w.on_page([&]() { pages++; });
+  w.bind("loaded", [&](std::string) -> std::string {
+    if (pages == 1) {
+      w.eval("location.reload()");
+    } else {
+      w.terminate();
+    }
+    return "";
+  });
+  w.init("window.onload = function() { loaded(); };");
+  w.navigate("data:text/html,%3Chtml%3Ehello%3C%2Fhtml%3E");
+  w.run();
+  assert(pages == 2);
 }
+#endif
 
 // =================================================================
 // TEST: use C API to create a window, run app and terminate it.
@@ -31,22 +268,294 @@ static void cb_terminate(webview_t w, void *arg) {
 }
 static void test_c_api() {
   webview_t w;
-  w = webview_create(false, nullptr);
+  w = webview_create(480, 320, 0, 0);
   webview_set_size(w, 480, 320, 0);
   webview_set_title(w, "Test");
+  webview_set_title_n(w, "Test title", 4);
   webview_navigate(w, "https://github.com/zserge/webview");
+  webview_eval_n(w, nullptr, 0);
   webview_dispatch(w, cb_assert_arg, (void *)"arg");
   webview_dispatch(w, cb_terminate, nullptr);
   webview_run(w);
   webview_destroy(w);
 }
 
+// =================================================================
+// TEST: results passed with a length don't need to be NUL-terminated.
+// =================================================================
+static void test_return_n() {
+  webview::webview w(480, 320);
+  w.bind(
+      "get",
+      [](std::string seq, std::string, void *arg) {
+        webview_return_n(arg, seq.c_str(), 0, "[1,2]garbage", 5);
+      },
+      &w);
+  w.bind("check", [&](std::string req) -> std::string {
+    assert(req == "[[1,2]]");
+    w.terminate();
+    return "";
+  });
+  w.init("window.onload = function() { get().then(check); };");
+  w.navigate("data:text/html,%3Chtml%3Ehello%3C%2Fhtml%3E");
+  w.run();
+}
+
+// =================================================================
+// TEST: large results reach the page intact.
+// =================================================================
+static void test_large_result() {
+  webview::webview w(480, 320);
+  w.bind("get", [&](std::string req) -> std::string {
+    auto n = std::stoul(webview::json_parse(req, "", 0));
+    return '"' + std::string(n, 'x') + '"';
+  });
+  w.bind("check", [&](std::string req) -> std::string {
+    assert(req == "[100000,3000000]");
+    w.terminate();
+    return "";
+  });
+  w.init(R"(
+    window.onload = function() {
+      Promise.all([get(100000), get(3000000)]).then(function(res) {
+        check(res[0].length, res[1].length);
+      });
+    };
+  )");
+  w.navigate("data:text/html,%3Chtml%3Ehello%3C%2Fhtml%3E");
+  w.run();
+}
+
+// =================================================================
+// TEST: prepared functions run in order with evals, also when invoked from
+// another thread.
+// =================================================================
+static void test_prepare() {
+  webview::webview w(480, 320);
+  std::thread worker;
+  int add =
+      w.prepare("function(a, b) { window.sum = (window.sum || 0) + a * b; }");
+  w.bind("loaded", [&](std::string) -> std::string {
+    for (int i = 1; i <= 50; i++) {
+      w.invoke(add, "[" + std::to_string(i) + ", 2]");
+    }
+    worker = std::thread([&]() {
+      for (int i = 51; i <= 100; i++) {
+        w.invoke(add, "[" + std::to_string(i) + ", 2]");
+      }
+      w.dispatch([&]() { w.eval("check(window.sum)"); });
+    });
+    return "";
+  });
+  w.bind("check", [&](std::string req) -> std::string {
+    assert(req == "[10100]");
+    w.terminate();
+    return "";
+  });
+  w.init("window.onload = function() { loaded(); };");
+  w.navigate("data:text/html,%3Chtml%3Ehello%3C%2Fhtml%3E");
+  w.run();
+  worker.join();
+}
+
+// =================================================================
+// TEST: script results and exceptions are read back natively.
+// =================================================================
+static void test_eval_async() {
+  webview::webview w(480, 320);
+  std::thread worker;
+  w.bind("loaded", [&](std::string) -> std::string {
+    worker = std::thread([&]() {
+      assert(w.eval_async("({a: [1, 'x']})").get() == R"({"a":[1,"x"]})");
+#if !defined(WEBVIEW_EDGE)
+      try {
+        w.eval_async("throw new Error('boom')").get();
+        assert(0);
+      } catch (std::runtime_error &e) {
+        assert(std::string(e.what()).find("boom") != std::string::npos);
+      }
+#endif
+      w.dispatch([&]() { w.terminate(); });
+    });
+    return "";
+  });
+  w.init("window.onload = function() { loaded(); };");
+  w.navigate("data:text/html,%3Chtml%3Ehello%3C%2Fhtml%3E");
+  w.run();
+  worker.join();
+}
+
+#if __cplusplus >= 202002L
+// =================================================================
+// TEST: a coroutine binding awaits page results, errors with quotes and
+// control characters make it through in both directions.
+// =================================================================
+static webview::task<std::string> coro_flow(webview::coro_webview &w,
+                                            std::string) {
+  co_await w.on_main();
+  auto sum = co_await w.eval_async("1 + 1");
+  auto doubled = co_await w.call_js("double", "[21]");
+  std::string missing = "none", bad = "none";
+  try {
+    co_await w.call_js("no\"such", "[]");
+  } catch (std::exception &) {
+    missing = "threw";
+  }
+  try {
+    co_await w.call_js("bad", "[]");
+  } catch (std::exception &e) {
+    bad = e.what();
+  }
+  co_return "[" + sum + "," + doubled + "," + webview::json_escape(missing) +
+      "," + webview::json_escape(bad) + "]";
+}
+
+static void test_coro() {
+  webview::coro_webview w(480, 320);
+  w.bind_coro("flow", coro_flow);
+  w.bind_coro("fail",
+              [](webview::coro_webview &, std::string)
+                  -> webview::task<std::string> {
+                throw std::runtime_error("bad \"quote\"");
+                co_return "";
+              });
+  w.bind("check", [&](std::string req) -> std::string {
+    assert(req == R"([[2,42,"threw","Error: a\u0001b"],"bad \"quote\""])");
+    w.terminate();
+    return "";
+  });
+  w.init(R"(
+    window.double = function(x) {
+      // Guessing the id of the pending call must not settle it.
+      window.external.invoke(JSON.stringify({
+        id: 1, method: '_webview_call', params: [0, '0'],
+      }));
+      return Promise.resolve(x * 2);
+    };
+    window.bad = function() { throw new Error('a\u0001b'); };
+    window.onload = function() {
+      flow().then(function(res) {
+        fail().then(null, function(e) { check(res, e); });
+      });
+    };
+  )");
+  w.navigate("data:text/html,%3Chtml%3Ehello%3C%2Fhtml%3E");
+  w.run();
+}
+#endif
+
+// =================================================================
+// TEST: calls beyond the limit of a binding are rejected, the latest one
+// always runs. The name needs escaping in the rejections.
+// =================================================================
+static void test_binding_limit() {
+  webview::webview w(480, 320);
+  std::string last;
+  w.bind("wo\"rk\\", [&](std::string req) -> std::string {
+    last = req;
+    return "";
+  });
+  w.set_binding_limit("wo\"rk\\", 4, webview::overflow_policy::merge_latest);
+  w.bind("check", [&](std::string req) -> std::string {
+    assert(req == "[100,true,true]");
+    assert(last == "[99]");
+    w.terminate();
+    return "";
+  });
+  w.init(R"(
+    window.onload = function() {
+      var calls = [], work = window['wo"rk\\'];
+      for (var i = 0; i < 100; i++) {
+        calls.push(work(i).then(function() { return 'ran'; }, function(e) {
+          var full = e.name === 'SaturatedError' && e.pending === 4 &&
+                     e.message === 'wo"rk\\ is saturated';
+          return full ? 'saturated' : String(e);
+        }));
+      }
+      Promise.all(calls).then(function(res) {
+        check(res.length, res.every(function(x) {
+          return x === 'ran' || x === 'saturated';
+        }), res.indexOf('saturated') >= 0);
+      });
+    };
+  )");
+  w.navigate("data:text/html,%3Chtml%3Ehello%3C%2Fhtml%3E");
+  w.run();
+}
+
+// =================================================================
+// TEST: rebinding and unbinding free the binding argument, the rest are
+// freed with the webview.
+// =================================================================
+static void cb_check_unbind(const char *, const char *req, void *arg) {
+  assert(std::string(req) == R"([2,"undefined"])");
+  webview_terminate(arg);
+}
+static void test_unbind() {
+  static int freed = 0;
+  auto ret = [](const char *seq, const char *, void *arg) {
+    webview_return(*static_cast<webview_t *>(arg), seq, 0, "2");
+  };
+  auto free_arg = [](void *arg) {
+    delete static_cast<webview_t *>(arg);
+    freed++;
+  };
+  webview_t w = webview_create(480, 320, 0, 0);
+  webview_bind_owned(w, "first", ret, new webview_t(w), free_arg);
+  webview_bind_owned(w, "first", ret, new webview_t(w), free_arg);
+  assert(freed == 1);
+  webview_bind_owned(w, "second", ret, new webview_t(w), free_arg);
+  webview_unbind(w, "second");
+  assert(freed == 2);
+  webview_bind(w, "check", cb_check_unbind, w);
+  webview_init(w, R"(
+    window.onload = function() {
+      first().then(function(x) { check(x, typeof window.second); });
+    };
+  )");
+  webview_navigate(w, "data:text/html,%3Chtml%3Ehello%3C%2Fhtml%3E");
+  webview_run(w);
+  webview_destroy(w);
+  assert(freed == 3);
+}
+
+// =================================================================
+// TEST: many bindings share one bootstrap script that runs before all init
+// scripts, init scripts with the same source and injection point run once
+// and scripts can wait for the document.
+// =================================================================
+static void test_bootstrap() {
+  webview::webview w(480, 320);
+  // Added before the bindings, still runs after the bootstrap.
+  w.init("window.early = typeof f0;");
+  for (int i = 0; i < 300; i++) {
+    w.bind("f" + std::to_string(i), [](std::string req) { return req; });
+  }
+  w.bind("check", [&](std::string req) -> std::string {
+    assert(req == R"([2,"function","loaded","function"])");
+    w.terminate();
+    return "";
+  });
+  auto count = "window.count = (window.count || 0) + 1;";
+  assert(w.init(count) == w.init(count));
+  assert(w.init(count, webview::inject_at::document_end) != w.init(count));
+  auto on_parsed = R"(
+    f299('loaded').then(function(res) {
+      check(window.count, typeof f150, res[0], window.early);
+    });
+  )";
+  w.init(on_parsed, webview::inject_at::document_end);
+  w.navigate("data:text/html,%3Chtml%3Ehello%3C%2Fhtml%3E");
+  w.run();
+}
+
 // =================================================================
 // TEST: ensure that JS code can call native code and vice versa.
 // =================================================================
 struct test_webview : webview::browser_engine {
   using cb_t = std::function<void(test_webview *, int, const std::string)>;
-  test_webview(cb_t cb) : webview::browser_engine(true, nullptr), m_cb(cb) {}
+  test_webview(cb_t cb)
+      : webview::browser_engine(480, 320, false, true), m_cb(cb) {}
   void on_message(const std::string msg) override { m_cb(this, i++, msg); }
   int i = 0;
   cb_t m_cb;
@@ -88,6 +597,45 @@ static void test_json() {
   assert(J(R"({"foo": {"bar": 1}})", "foo", -1) == R"({"bar": 1})");
   assert(J(R"(["foo", "bar", "baz"])", "", 0) == "foo");
   assert(J(R"(["foo", "bar", "baz"])", "", 2) == "baz");
+
+  auto E = webview::json_escape;
+  assert(E("") == R"("")");
+  assert(E(R"(a"b\c)") == R"("a\"b\\c")");
+  assert(E("line\n\ttab\x01") == R"("line\n\ttab\u0001")");
+  assert(E("\xe2\x80\xa8\xe2\x80\xa9") == R"("\u2028\u2029")");
+  assert(E("caf\xc3\xa9") == "\"caf\xc3\xa9\"");
+
+  // Escaped strings decode back, \u escapes included.
+  auto tricky = std::string("q\"b\\s\x01\x1f\xe2\x80\xa8 \xf0\x9f\x98\x80");
+  assert(J("[" + E(tricky) + "]", "", 0) == tricky);
+  assert(J(R"(["\u00e9\ud83d\ude00\u0041"])", "", 0) ==
+         "\xc3\xa9\xf0\x9f\x98\x80" "A");
+  assert(J(R"(["\ud800x"])", "", 0) == "\xef\xbf\xbdx");
+  assert(J(R"(["\u12"])", "", 0) == "");
+}
+
+// =================================================================
+// TEST: move-only closures, stored inline or boxed in a slab pool.
+// =================================================================
+static void test_unique_function() {
+  webview::slab_pool pool;
+  std::unique_ptr<int> p(new int(40));
+  struct add {
+    std::unique_ptr<int> p;
+    int operator()(int x) { return *p + x; }
+  };
+  webview::unique_function<int(int)> small(add{std::move(p)}, &pool);
+  assert(small(2) == 42);
+  struct big {
+    char pad[256];
+    int operator()(int x) { return x + 1; }
+  };
+  webview::unique_function<int(int)> boxed(big{}, &pool);
+  webview::unique_function<int(int)> moved(std::move(boxed));
+  assert(!boxed);
+  assert(moved(41) == 42);
+  moved = nullptr;
+  assert(!moved);
 }
 
 static void run_with_timeout(std::function<void()> fn, int timeout_ms) {
@@ -111,9 +659,31 @@ static void run_with_timeout(std::function<void()> fn, int timeout_ms) {
 int main(int argc, char *argv[]) {
   std::unordered_map<std::string, std::function<void()>> all_tests = {
       {"terminate", test_terminate},
+      {"dispatch_threads", test_dispatch_threads},
+      {"dispatch_keyed", test_dispatch_keyed},
+      {"dispatch_sync", test_dispatch_sync},
+      {"watchdog", test_watchdog},
+      {"utilization", test_utilization},
+#if defined(WEBVIEW_GTK)
+      {"dispatch_budget", test_dispatch_budget},
+      {"timers", test_timers},
+      {"loop_fd", test_loop_fd},
+      {"page_callback", test_page_callback},
+#endif
       {"c_api", test_c_api},
+      {"return_n", test_return_n},
+      {"large_result", test_large_result},
+      {"unbind", test_unbind},
+      {"binding_limit", test_binding_limit},
+      {"prepare", test_prepare},
+      {"eval_async", test_eval_async},
+#if __cplusplus >= 202002L
+      {"coro", test_coro},
+#endif
+      {"bootstrap", test_bootstrap},
       {"bidir_comms", test_bidir_comms},
       {"json", test_json},
+      {"unique_function", test_unique_function},
   };
   // Without arguments run all tests, one-by-one by forking itself.
   // With a single argument - run the requested test
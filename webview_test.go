@@ -1,9 +1,15 @@
 package webview
 
 import (
+	"bytes"
+	"context"
+	"encoding/json"
+	"errors"
 	"flag"
+	"fmt"
 	"log"
 	"os"
+	"sync"
 	"testing"
 )
 
@@ -42,10 +48,314 @@ func Example() {
 	w.Run()
 }
 
+func TestHandleTable(t *testing.T) {
+	var table handleTable
+	a := table.alloc("a")
+	if v := table.lookup(a); v != "a" {
+		t.Fatalf("lookup(a) = %v", v)
+	}
+	if v := table.release(a); v != "a" {
+		t.Fatalf("release(a) = %v", v)
+	}
+	if v := table.release(a); v != nil {
+		t.Fatalf("second release(a) = %v", v)
+	}
+	// The slot is reused with a new generation, the old handle stays dead.
+	b := table.alloc("b")
+	if b&handleIndexMask != a&handleIndexMask || b == a {
+		t.Fatalf("slot not reused: a=%x b=%x", a, b)
+	}
+	if v := table.lookup(a); v != nil {
+		t.Fatalf("stale lookup(a) = %v", v)
+	}
+	// Handles stay valid while the table grows.
+	handles := []uintptr{}
+	for i := 0; i < 3*handleChunkSize; i++ {
+		handles = append(handles, table.alloc(i))
+	}
+	for i, h := range handles {
+		if v := table.lookup(h); v != i {
+			t.Fatalf("lookup(%x) = %v, want %d", h, v, i)
+		}
+	}
+	if v := table.lookup(b); v != "b" {
+		t.Fatalf("lookup(b) = %v", v)
+	}
+}
+
+func TestHandleTableConcurrent(t *testing.T) {
+	var table handleTable
+	var wg sync.WaitGroup
+	for g := 0; g < 8; g++ {
+		wg.Add(1)
+		go func(g int) {
+			defer wg.Done()
+			for i := 0; i < 10000; i++ {
+				h := table.alloc(g)
+				if v := table.release(h); v != g {
+					t.Errorf("release(%x) = %v, want %d", h, v, g)
+					return
+				}
+			}
+		}(g)
+	}
+	wg.Wait()
+}
+
+func TestDispatchQueue(t *testing.T) {
+	var q dispatchQueue
+	order := ""
+	if !q.push(func() { order += "a" }) {
+		t.Fatal("first push must wake up the main thread")
+	}
+	if q.push(func() {
+		order += "b"
+		if !q.push(func() { order += "c" }) {
+			t.Error("push while draining must wake up the main thread again")
+		}
+	}) {
+		t.Fatal("second push must join the batch")
+	}
+	q.drain()
+	if order != "ab" {
+		t.Fatalf("first batch ran %q", order)
+	}
+	q.drain()
+	if order != "abc" {
+		t.Fatalf("second batch ran %q", order)
+	}
+}
+
+// Run with -cpu 1,2,4,8 to see how Dispatch handles scale. One goroutine
+// stands in for the main thread and drains the queue when woken up.
+func BenchmarkDispatchQueue(b *testing.B) {
+	var q dispatchQueue
+	wake := make(chan struct{}, 1)
+	done := make(chan struct{})
+	go func() {
+		for range wake {
+			q.drain()
+		}
+		q.drain()
+		close(done)
+	}()
+	f := func() {}
+	b.RunParallel(func(pb *testing.PB) {
+		for pb.Next() {
+			if q.push(f) {
+				wake <- struct{}{}
+			}
+		}
+	})
+	close(wake)
+	<-done
+}
+
+func BenchmarkHandleTableBinding(b *testing.B) {
+	var table handleTable
+	h := table.alloc(bindingFunc(nil))
+	b.RunParallel(func(pb *testing.PB) {
+		for pb.Next() {
+			if _, ok := table.lookup(h).(bindingFunc); !ok {
+				b.Error("binding lost")
+			}
+		}
+	})
+}
+
+func TestBindingPlan(t *testing.T) {
+	call := func(f interface{}, req string) (interface{}, error) {
+		binding, err := newBinding(f)
+		if err != nil {
+			t.Fatal(err)
+		}
+		return binding("1", req)
+	}
+	if res, err := call(func(a, b int) int { return a + b }, "[1,2]"); res != 3 || err != nil {
+		t.Fatalf("add = %v, %v", res, err)
+	}
+	if _, err := call(func(a, b int) int { return a + b }, "[1]"); err == nil {
+		t.Fatal("missing argument accepted")
+	}
+	if _, err := call(func(a, b int) int { return a + b }, "[1,2,3]"); err == nil {
+		t.Fatal("extra argument accepted")
+	}
+	if res, err := call(func(s string, n ...int) int { return len(s) + len(n) }, `["ab",1,2]`); res != 4 || err != nil {
+		t.Fatalf("variadic = %v, %v", res, err)
+	}
+	if res, err := call(func() error { return errors.New("fail") }, "[]"); res != nil || err == nil {
+		t.Fatalf("error = %v, %v", res, err)
+	}
+	if res, err := call(func() (string, error) { return "ok", nil }, "[]"); res != "ok" || err != nil {
+		t.Fatalf("value+error = %v, %v", res, err)
+	}
+	if _, err := newBinding(func() (int, int) { return 0, 0 }); err == nil {
+		t.Fatal("second result must be an error")
+	}
+	async, err := newBindingPlan(func(ctx context.Context, n int, rest ...int) (int, error) {
+		return n + len(rest), ctx.Err()
+	}, true)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if res, err := async.callAsync(context.Background(), "[1,2,3]"); res != 3 || err != nil {
+		t.Fatalf("async = %v, %v", res, err)
+	}
+	ctx, cancel := context.WithCancel(context.Background())
+	cancel()
+	if _, err := async.callAsync(ctx, "[1]"); err != context.Canceled {
+		t.Fatalf("cancelled async = %v", err)
+	}
+	if _, err := newBindingPlan(func(n int) {}, true); err == nil {
+		t.Fatal("async binding without a context accepted")
+	}
+	typed := binding2(func(a string, b struct{ N int }) (string, error) {
+		return a + string(rune('0'+b.N)), nil
+	})
+	if res, err := typed("1", `["x",{"N":7}]`); res != "x7" || err != nil {
+		t.Fatalf("typed = %v, %v", res, err)
+	}
+	if _, err := typed("1", `["x"]`); err == nil {
+		t.Fatal("typed binding accepted a missing argument")
+	}
+}
+
+func TestEncodeResult(t *testing.T) {
+	for _, test := range []struct {
+		res  interface{}
+		json string
+	}{
+		{nil, "null"},
+		{map[string]int{"a": 1}, `{"a":1}`},
+		{json.RawMessage(`{"cached":true}`), `{"cached":true}`},
+		{JS(`[1,2,3]`), `[1,2,3]`},
+		{[]byte(`[1,2,3]`), `"WzEsMiwzXQ=="`},
+		{bytes.NewBufferString(`"streamed"`), `{}`},
+	} {
+		buf := newResultBuffer()
+		if err := encodeResult(buf, test.res); err != nil {
+			t.Fatal(err)
+		}
+		if got := string(bytes.TrimSpace(buf.Bytes())); got != test.json {
+			t.Errorf("encodeResult(%v) = %s, want %s", test.res, got, test.json)
+		}
+	}
+	if err := encodeResult(newResultBuffer(), func() {}); err == nil {
+		t.Error("function result encoded")
+	}
+}
+
+func BenchmarkBindingReflect(b *testing.B) {
+	binding, _ := newBinding(func(s string, n int) (int, error) {
+		return len(s) + n, nil
+	})
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		binding("1", `["hello",42]`)
+	}
+}
+
+func BenchmarkBindingTyped(b *testing.B) {
+	binding := binding2(func(s string, n int) (int, error) {
+		return len(s) + n, nil
+	})
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		binding("1", `["hello",42]`)
+	}
+}
+
+// bench is the webview shared by the benchmarks. They need a display and
+// the main loop running on the main thread, so TestMain opens its window
+// only when benchmarks are run, e.g. with xvfb-run go test -bench .
+var bench struct {
+	w    WebView
+	done chan struct{}
+}
+
+const benchScript = `
+	window.roundTrips = async function(n, size) {
+		var payload = 'x'.repeat(size);
+		for (var i = 0; i < n; i++) {
+			await window.echo(payload);
+		}
+		window.done();
+	};
+	window.concurrentCalls = async function(n, inflight) {
+		var next = 0;
+		async function worker() {
+			while (next < n) {
+				next++;
+				await window.echo('');
+			}
+		}
+		var workers = [];
+		for (var i = 0; i < inflight; i++) {
+			workers.push(worker());
+		}
+		await Promise.all(workers);
+		window.done();
+	};
+	window.onload = function() { window.done(); };
+`
+
+// runBenchJS evaluates a script that calls window.done() when it is finished.
+func runBenchJS(b *testing.B, js string) {
+	b.ReportAllocs()
+	b.ResetTimer()
+	bench.w.Dispatch(func() { bench.w.Eval(js) })
+	<-bench.done
+}
+
+func benchmarkRoundTrip(b *testing.B, size int) {
+	b.SetBytes(int64(2 * size))
+	runBenchJS(b, fmt.Sprintf("roundTrips(%d, %d)", b.N, size))
+}
+
+func BenchmarkRoundTripEmpty(b *testing.B) { benchmarkRoundTrip(b, 0) }
+func BenchmarkRoundTrip1KB(b *testing.B)   { benchmarkRoundTrip(b, 1<<10) }
+func BenchmarkRoundTrip1MB(b *testing.B)   { benchmarkRoundTrip(b, 1<<20) }
+
+func BenchmarkConcurrentCalls(b *testing.B) {
+	runBenchJS(b, fmt.Sprintf("concurrentCalls(%d, 64)", b.N))
+}
+
+// Dispatch from GOMAXPROCS goroutines, vary them with -cpu.
+func BenchmarkDispatch(b *testing.B) {
+	var wg sync.WaitGroup
+	wg.Add(b.N)
+	b.ReportAllocs()
+	b.ResetTimer()
+	b.RunParallel(func(pb *testing.PB) {
+		for pb.Next() {
+			bench.w.Dispatch(wg.Done)
+		}
+	})
+	wg.Wait()
+}
+
 func TestMain(m *testing.M) {
 	flag.Parse()
 	if testing.Verbose() {
 		Example()
 	}
-	os.Exit(m.Run())
+	if flag.Lookup("test.bench").Value.String() == "" {
+		os.Exit(m.Run())
+	}
+	w := New(480, 320, false, false)
+	bench.done = make(chan struct{}, 1)
+	w.Bind("echo", func(s string) string { return s })
+	w.Bind("done", func() { bench.done <- struct{}{} })
+	w.Init(benchScript)
+	w.Navigate("data:text/html,<html><body>bench</body></html>")
+	code := make(chan int, 1)
+	go func() {
+		<-bench.done
+		bench.w = w
+		code <- m.Run()
+		w.Dispatch(w.Terminate)
+	}()
+	w.Run()
+	w.Destroy()
+	os.Exit(<-code)
 }
@@ -16,7 +16,11 @@
 #include <windows.h>
 #include <wrl.h>
 #include <winuser.h>
+#include <algorithm>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 #include <locale>
 #include <iostream>
 #include "webview2.h"
@@ -31,9 +35,11 @@ class browser {
 public:
   virtual ~browser() = default;
   virtual bool embed(HWND, bool, msg_cb_t) = 0;
-  virtual void navigate(const std::string url) = 0;
-  virtual void eval(const std::string js) = 0;
-  virtual void init(const std::string js) = 0;
+  virtual void navigate(const std::string &url) = 0;
+  virtual void eval(const std::string &js) = 0;
+  virtual void eval_async(const std::string &js, eval_callback_t fn) = 0;
+  virtual int init(const std::string &js, inject_at at) = 0;
+  virtual void uninit(int id) = 0;
   virtual void resize(HWND) = 0;
 };
 
@@ -87,7 +93,8 @@ public:
     m_webview->get_Settings(&Settings);
     Settings->put_AreDevToolsEnabled(m_debug);
 
-    init("window.external={invoke:s=>window.chrome.webview.postMessage(s)}");
+    init("window.external={invoke:s=>window.chrome.webview.postMessage(s)}",
+         inject_at::document_start);
     return true;
   }
 
@@ -100,34 +107,162 @@ public:
     m_controller->put_Bounds(bounds);
   }
 
-  void navigate(const std::string url) override {
+  void navigate(const std::string &url) override {
     auto wurl = to_lpwstr(url);
     m_webview->Navigate(wurl);
     delete[] wurl;
   }
 
-  void init(const std::string js) override {
-    LPCWSTR wjs = to_lpwstr(js);
-    m_webview->AddScriptToExecuteOnDocumentCreated(wjs, nullptr);
+  int init(const std::string &js, inject_at at) override {
+    int id = ++m_last_script;
+    // WebView2 runs scripts only when the document is created.
+    LPCWSTR wjs = to_lpwstr(
+        at == inject_at::document_end
+            ? "document.addEventListener('DOMContentLoaded', function() {\n" +
+                  js + "\n});"
+            : js);
+    auto handler = new script_added_handler(this, m_alive, id);
+    m_webview->AddScriptToExecuteOnDocumentCreated(wjs, handler);
+    handler->Release();
     delete[] wjs;
+    return id;
+  }
+
+  void uninit(int id) override {
+    auto it = m_script_ids.find(id);
+    if (it == m_script_ids.end()) {
+      // WebView2 has not reported the script id yet.
+      m_uninit_pending.push_back(id);
+      return;
+    }
+    m_webview->RemoveScriptToExecuteOnDocumentCreated(it->second.c_str());
+    m_script_ids.erase(it);
   }
 
-  void eval(const std::string js) override {
+  void eval(const std::string &js) override {
     LPCWSTR wjs = to_lpwstr(js);
     m_webview->ExecuteScript(wjs, nullptr);
     delete[] wjs;
   }
 
+  // WebView2 reports scripts that threw as returning null.
+  void eval_async(const std::string &js, eval_callback_t fn) override {
+    LPCWSTR wjs = to_lpwstr(js);
+    auto handler = new eval_handler(std::move(fn));
+    m_webview->ExecuteScript(wjs, handler);
+    handler->Release();
+    delete[] wjs;
+  }
+
 private:
-  LPWSTR to_lpwstr(const std::string s) {
+  LPWSTR to_lpwstr(const std::string &s) {
     int n = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, NULL, 0);
     wchar_t *ws = new wchar_t[n];
     MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, ws, n);
     return ws;
   }
+  void script_added(int id, LPCWSTR script_id) {
+    auto it = std::find(m_uninit_pending.begin(), m_uninit_pending.end(), id);
+    if (it != m_uninit_pending.end()) {
+      m_uninit_pending.erase(it);
+      m_webview->RemoveScriptToExecuteOnDocumentCreated(script_id);
+      return;
+    }
+    m_script_ids[id] = script_id;
+  }
+
   bool m_debug;
   ICoreWebView2 *m_webview = nullptr;
   ICoreWebView2Controller *m_controller = nullptr;
+  int m_last_script = 0;
+  std::map<int, std::wstring> m_script_ids;
+  std::vector<int> m_uninit_pending;
+  // Expires with the browser, completions arriving later are ignored.
+  std::shared_ptr<int> m_alive = std::make_shared<int>(0);
+
+  class eval_handler : public ICoreWebView2ExecuteScriptCompletedHandler {
+  public:
+    eval_handler(eval_callback_t fn) : m_fn(std::move(fn)) {}
+    ULONG STDMETHODCALLTYPE AddRef() { return ++m_refs; }
+    ULONG STDMETHODCALLTYPE Release() {
+      if (--m_refs == 0) {
+        delete this;
+        return 0;
+      }
+      return m_refs;
+    }
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, LPVOID *ppv) {
+      if (ppv == nullptr) {
+        return E_POINTER;
+      }
+      if (IsEqualIID(riid, IID_IUnknown) ||
+          IsEqualIID(riid, IID_ICoreWebView2ExecuteScriptCompletedHandler)) {
+        *ppv = static_cast<ICoreWebView2ExecuteScriptCompletedHandler *>(this);
+        AddRef();
+        return S_OK;
+      }
+      *ppv = nullptr;
+      return E_NOINTERFACE;
+    }
+    HRESULT STDMETHODCALLTYPE Invoke(HRESULT res, LPCWSTR json) {
+      if (res != S_OK) {
+        m_fn("", "Script failed");
+        return S_OK;
+      }
+      std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>> converter;
+      m_fn(converter.to_bytes(json), "");
+      return S_OK;
+    }
+
+  private:
+    eval_callback_t m_fn;
+    ULONG m_refs = 1;
+  };
+
+  using script_added_handler_t =
+      ICoreWebView2AddScriptToExecuteOnDocumentCreatedCompletedHandler;
+  class script_added_handler : public script_added_handler_t {
+  public:
+    script_added_handler(edge_chromium *browser, std::weak_ptr<int> alive,
+                         int id)
+        : m_browser(browser), m_alive(std::move(alive)), m_id(id) {}
+    ULONG STDMETHODCALLTYPE AddRef() { return ++m_refs; }
+    ULONG STDMETHODCALLTYPE Release() {
+      if (--m_refs == 0) {
+        delete this;
+        return 0;
+      }
+      return m_refs;
+    }
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, LPVOID *ppv) {
+      if (ppv == nullptr) {
+        return E_POINTER;
+      }
+      if (IsEqualIID(riid, IID_IUnknown) ||
+          IsEqualIID(
+              riid,
+              IID_ICoreWebView2AddScriptToExecuteOnDocumentCreatedCompletedHandler)) {
+        *ppv = static_cast<script_added_handler_t *>(this);
+        AddRef();
+        return S_OK;
+      }
+      *ppv = nullptr;
+      return E_NOINTERFACE;
+    }
+    HRESULT STDMETHODCALLTYPE Invoke(HRESULT res, LPCWSTR id) {
+      // The completion may arrive after the browser is gone.
+      if (res == S_OK && !m_alive.expired()) {
+        m_browser->script_added(m_id, id);
+      }
+      return S_OK;
+    }
+
+  private:
+    edge_chromium *m_browser;
+    std::weak_ptr<int> m_alive;
+    int m_id;
+    ULONG m_refs = 1;
+  };
 
   class webview2_com_handler
       : public ICoreWebView2CreateCoreWebView2EnvironmentCompletedHandler,
@@ -279,23 +414,33 @@ public:
     MSG msg;
     BOOL res;
     while ((res = GetMessage(&msg, nullptr, 0, 0)) != -1) {
-      
-      if (msg.hwnd) {
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
-        continue;
-      }
-      if (msg.message == WM_APP) {
-        auto f = (dispatch_fn_t *)(msg.lParam);
-        (*f)();
-        delete f;
-      } else if (msg.message == WM_QUIT) {
+      if (!handle_message(msg)) {
         return;
       }
     }
   }
 
-  LPWSTR to_lpwstr(const std::string s) {
+  // The message queue has no pollable fd, external loops should wait with
+  // MsgWaitForMultipleObjects() and then call loop_iterate(false).
+  int loop_fd() { return -1; }
+
+  bool loop_iterate(bool blocking) {
+    MSG msg;
+    if (blocking) {
+      if (GetMessage(&msg, nullptr, 0, 0) == -1) {
+        return false;
+      }
+      return handle_message(msg);
+    }
+    while (PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+      if (!handle_message(msg)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  LPWSTR to_lpwstr(const std::string &s) {
     int n = MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, NULL, 0);
     wchar_t *ws = new wchar_t[n];
     MultiByteToWideChar(CP_UTF8, 0, s.c_str(), -1, ws, n);
@@ -303,6 +448,7 @@ public:
   }
 
   void *window() { return (void *)m_window; }
+  bool is_main_thread() const { return GetCurrentThreadId() == m_main_thread; }
   void hide() {
     ShowWindow(m_window, SW_HIDE);
   }
@@ -310,14 +456,28 @@ public:
     ShowWindow(m_window, SW_SHOW);
   }
   void terminate() { PostQuitMessage(0); }
+  // Thread messages are handled in order, priorities only affect the GTK
+  // backend.
+  void dispatch(dispatch_priority, dispatch_fn_t f) { dispatch(std::move(f)); }
   void dispatch(dispatch_fn_t f) {
-    PostThreadMessage(m_main_thread, WM_APP, 0, (LPARAM) new dispatch_fn_t(f));
+    PostThreadMessage(m_main_thread, WM_APP, 0,
+                      (LPARAM) new dispatch_fn_t(std::move(f)));
   }
 
   void set_icon(const std::string icon) {
   }
 
-  void set_title(const std::string title) {
+  // Dispatched closures are not budgeted on this backend.
+  void set_dispatch_budget(int, int = 16667) {}
+  webview_stats_t stats() { return webview_stats_t{}; }
+
+  // Main loop timers are not available on this backend.
+  template <typename F> webview_timer_t dispatch_after(int, F &&) { return 0; }
+  template <typename F> webview_timer_t every(int, F &&) { return 0; }
+  bool cancel_timer(webview_timer_t) { return false; }
+  void set_timer_tolerance(int) {}
+
+  void set_title(const std::string &title) {
     SetWindowTextW(m_window, to_lpwstr(title));
   }
 
@@ -352,12 +512,46 @@ public:
     }
   }
 
-  void navigate(const std::string url) { m_browser->navigate(url); }
-  void eval(const std::string js) { m_browser->eval(js); }
-  void init(const std::string js) { m_browser->init(js); }
+  void navigate(const std::string &url) { m_browser->navigate(url); }
+  void eval(const std::string &js) { m_browser->eval(js); }
+  void eval_async(const std::string &js, eval_callback_t fn) {
+    m_browser->eval_async(js, std::move(fn));
+  }
+  int init(const std::string &js, inject_at at = inject_at::document_start) {
+    return m_browser->init(js, at);
+  }
+  void uninit(int id) { m_browser->uninit(id); }
 
 private:
+  // Returns false for WM_QUIT.
+  bool handle_message(MSG &msg) {
+    if (msg.hwnd) {
+      load_meter::scope load(m_load, main_activity::events);
+      TranslateMessage(&msg);
+      DispatchMessage(&msg);
+      return true;
+    }
+    if (msg.message == WM_APP) {
+      auto f = (dispatch_fn_t *)(msg.lParam);
+      {
+        task_monitor::scope task(m_monitor, "dispatch");
+        load_meter::scope load(m_load, main_activity::dispatch);
+        (*f)();
+      }
+      delete f;
+    } else if (msg.message == WM_QUIT) {
+      return false;
+    }
+    return true;
+  }
+
   virtual void on_message(const std::string msg) = 0;
+
+protected:
+  task_monitor m_monitor;
+  load_meter m_load;
+
+private:
   bool m_hide;
   HWND m_window;
   POINT m_minsz = POINT{0, 0};